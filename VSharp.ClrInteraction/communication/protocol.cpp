@@ -2,28 +2,35 @@
 #include "../logging.h"
 #include "../probes.h"
 
+#include <climits>
 #include <cstring>
 #include <iostream>
+#include <vector>
 
 using namespace vsharp;
 
+// NOTE: frames only grow, so steady state commands are encoded without allocations
+static thread_local std::vector<char> frameBuffer;
+static thread_local size_t frameSize = 0;
+// NOTE: execution results are read into the same buffer, which stays valid until the next result of the thread
+static thread_local std::vector<char> execResultBuffer;
+
 bool Protocol::readConfirmation() {
-    char *buffer = new char[1];
-    int bytesRead = m_communicator.read(buffer, 1);
-    if (bytesRead != 1 || buffer[0] != Confirmation) {
+    char confirmation;
+    int bytesRead = m_communicator.read(&confirmation, 1);
+    if (bytesRead != 1 || confirmation != Confirmation) {
         LOG_ERROR(tout << "Communication with server: could not get the confirmation message. Instead read "
                        << bytesRead << " bytes with message [";
-              for (int i = 0; i < bytesRead; ++i) tout << buffer[i] << " ";
+              if (bytesRead == 1) tout << confirmation << " ";
               tout << "].");
-        delete[] buffer;
         return false;
     }
-    delete[] buffer;
     return true;
 }
 
 bool Protocol::writeConfirmation() {
-    int bytesWritten = m_communicator.write(new char[1] {Confirmation}, 1);
+    char confirmation = Confirmation;
+    int bytesWritten = m_communicator.write(&confirmation, 1);
     if (bytesWritten != 1) {
         LOG_ERROR(tout << "Communication with server: could not send the confirmation message. Instead sent"
                        << bytesWritten << " bytes.");
@@ -51,7 +58,7 @@ bool Protocol::writeCount(int count) {
     return true;
 }
 
-bool Protocol::readBuffer(char *&buffer, int &count) {
+bool Protocol::readBufferSize(int &count) {
     if (!readCount(count)) {
         return false;
     }
@@ -59,25 +66,31 @@ bool Protocol::readBuffer(char *&buffer, int &count) {
         LOG_ERROR(tout << "Communication with server: the amount of bytes is unexpectedly non-positive (count = " << count << ") ");
         return false;
     }
-    if (!writeConfirmation()) return false;
-    buffer = new char[count];
-    char *bufferBeginning = buffer;
+    return writeConfirmation();
+}
+
+bool Protocol::readBufferContents(char *buffer, int count) {
     int bytesRead = 0;
     while (bytesRead < count) {
-        int newBytesCount = m_communicator.read(buffer, count - bytesRead);
+        int newBytesCount = m_communicator.read(buffer + bytesRead, count - bytesRead);
         if (newBytesCount == 0) break;
         bytesRead += newBytesCount;
-        buffer += newBytesCount;
     }
-    buffer = bufferBeginning;
     if (bytesRead != count) {
         LOG_ERROR(tout << "Communication with server: expected " << count << " bytes, but read " << bytesRead << " bytes");
-        delete[] buffer;
-        buffer = nullptr;
         return false;
     }
     if (!writeConfirmation()) {
         LOG_ERROR(tout << "Communication with server: I've got the message, but could not confirm it.");
+        return false;
+    }
+    return true;
+}
+
+bool Protocol::readBuffer(char *&buffer, int &count) {
+    if (!readBufferSize(count)) return false;
+    buffer = new char[count];
+    if (!readBufferContents(buffer, count)) {
         delete[] buffer;
         buffer = nullptr;
         return false;
@@ -85,6 +98,13 @@ bool Protocol::readBuffer(char *&buffer, int &count) {
     return true;
 }
 
+bool Protocol::readBuffer(std::vector<char> &buffer, int &count) {
+    if (!readBufferSize(count)) return false;
+    // NOTE: shrinking keeps capacity, so the buffer is reallocated only for the longest message so far
+    buffer.resize(count);
+    return readBufferContents(buffer.data(), count);
+}
+
 bool Protocol::writeBuffer(char *buffer, int count) {
     if (!writeCount(count) || !readConfirmation()) {
         return false;
@@ -101,6 +121,39 @@ bool Protocol::writeBuffer(char *buffer, int count) {
     return true;
 }
 
+char *Protocol::beginFrame(char commandByte, size_t payloadSize) {
+    const size_t headerSize = sizeof(int) + sizeof(char);
+    frameSize = headerSize + payloadSize;
+    if (frameSize > (size_t) INT_MAX)
+        FAIL_LOUD("Communication with server: too large command!");
+    if (frameBuffer.size() < frameSize)
+        frameBuffer.resize(frameSize);
+    char *buffer = frameBuffer.data();
+    *(int *)buffer = (int) (payloadSize + sizeof(char));
+    buffer[sizeof(int)] = commandByte;
+    return buffer + headerSize;
+}
+
+bool Protocol::sendFrame() {
+    char *buffer = frameBuffer.data();
+    int count = (int) frameSize;
+    int bytesWritten = 0;
+    while (bytesWritten < count) {
+        int newBytesCount = m_communicator.write(buffer + bytesWritten, count - bytesWritten);
+        if (newBytesCount <= 0) break;
+        bytesWritten += newBytesCount;
+    }
+    if (bytesWritten != count) {
+        LOG_ERROR(tout << "Communication with server: could not sent the command. Instead sent " << bytesWritten << " of " << count << " bytes");
+        return false;
+    }
+    if (!readConfirmation()) {
+        LOG_ERROR(tout << "Communication with server: command sent, but no confirmation.");
+        return false;
+    }
+    return true;
+}
+
 bool Protocol::handshake() {
     const char *expectedMessage = "Hi!";
     char *message;
@@ -198,9 +251,10 @@ bool Protocol::acceptMethodBody(char *&bytecode, int &codeLength, unsigned &maxS
 }
 
 void Protocol::acceptExecResult(char *&bytes, int &messageLength) {
-    if (!readBuffer(bytes, messageLength)) {
+    if (!readBuffer(execResultBuffer, messageLength)) {
         FAIL_LOUD("Exec response validation failed!");
     }
+    bytes = execResultBuffer.data();
     assert(messageLength >= 5);
 }
 
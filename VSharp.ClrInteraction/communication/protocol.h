@@ -2,6 +2,8 @@
 #define PROTOCOL_H_
 
 #include "communicator.h"
+#include <cstddef>
+#include <vector>
 
 namespace vsharp {
 
@@ -10,7 +12,8 @@ enum CommandType {
     InstrumentCommand = 0x56,
     ExecuteCommand = 0x57,
     ReadMethodBody = 0x58,
-    ReadString = 0x59
+    ReadString = 0x59,
+    HeapStatsCommand = 0x5A
 };
 
 class Protocol {
@@ -23,11 +26,18 @@ private:
     bool readCount(int &count);
     bool writeCount(int count);
 
+    bool readBufferSize(int &count);
+    bool readBufferContents(char *buffer, int count);
     bool readBuffer(char *&buffer, int &count);
+    bool readBuffer(std::vector<char> &buffer, int &count);
     bool writeBuffer(char *buffer, int count);
 
     bool handshake();
 
+    // NOTE: commands are sent in one frame: [length][command byte][payload], confirmed by server once
+    char *beginFrame(char commandByte, size_t payloadSize);
+    bool sendFrame();
+
 public:
     bool connect();
     bool sendProbes();
@@ -39,14 +49,11 @@ public:
     bool acceptMethodBody(char *&bytecode, int &codeLength, unsigned &maxStackSize, char *&ehs, unsigned &ehsLength);
     template<typename T>
     bool sendSerializable(char commandByte, const T &object) {
-        if (!writeBuffer(new char[1] {commandByte}, 1)) return false;
-        char *bytes;
-        unsigned count;
-        object.serialize(bytes, count);
-        bool result = writeBuffer(bytes, count);
-        delete[] bytes;
-        return result;
+        char *buffer = beginFrame(commandByte, object.serializedSize());
+        object.serialize(buffer);
+        return sendFrame();
     }
+    // NOTE: 'bytes' point to thread-local buffer, which is reused by the next result, so they must not be freed
     void acceptExecResult(char *&bytes, int &messageLength);
     bool shutdown();
 };
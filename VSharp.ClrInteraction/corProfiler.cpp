@@ -5,13 +5,63 @@
 #include "instrumenter.h"
 #include "communication/protocol.h"
 #include "memory/memory.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 
 #define UNUSED(x) (void)x
 
 using namespace vsharp;
 
-CorProfiler::CorProfiler() : refCount(0), corProfilerInfo(nullptr), instrumenter(nullptr)
+static SIZE readLargeObjectSize()
+{
+    // NOTE: runtime reads threshold as hexadecimal number and never lowers it below default
+    const SIZE defaultSize = 85000;
+    const char *envVars[] = { "DOTNET_GCLOHThreshold", "COMPlus_GCLOHThreshold" };
+    for (const char *envVar : envVars) {
+        const char *value = getenv(envVar);
+        if (!value)
+            continue;
+        auto size = (SIZE) strtoull(value, nullptr, 16);
+        return size > defaultSize ? size : defaultSize;
+    }
+    return defaultSize;
+}
+
+CorProfiler::CorProfiler() : refCount(0), corProfilerInfo(nullptr), instrumenter(nullptr), sizeTRangesReported(false), largeObjectSize(readLargeObjectSize()), gcEpoch(1), typeDescriptorsEpoch(1)
+{
+}
+
+CorProfiler *CorProfiler::lazyHeapProfiler = nullptr;
+
+void CorProfiler::registerSeenObject(INT_PTR ref)
+{
+    if (ref == 0)
+        return;
+    // NOTE: concurrent registrations of one object must not produce duplicates
+    static std::mutex registrationLock;
+    std::lock_guard<std::mutex> lock(registrationLock);
+    if (heap.contains(ref))
+        return;
+    CorProfiler *profiler = lazyHeapProfiler;
+    // NOTE: fails for addresses outside of GC heap, for example, for references to stack
+    COR_PRF_GC_GENERATION_RANGE range;
+    if (FAILED(profiler->corProfilerInfo->GetObjectGeneration(ref, &range)))
+        return;
+    ULONG size;
+    ClassID classId;
+    if (FAILED(profiler->corProfilerInfo->GetObjectSize(ref, &size)) || FAILED(profiler->corProfilerInfo->GetClassFromObject(ref, &classId))) {
+        LOG_ERROR(tout << "lazy heap: unable to register object " << std::hex << ref);
+        return;
+    }
+    heap.registerObject(ref, size, profiler->typeDescriptor(classId), (int) range.generation);
+}
+
+bool CorProfiler::gcHeapContains(INT_PTR address)
 {
+    // NOTE: runtime finds generation of address by ranges of heap, so interior pointers are accepted
+    COR_PRF_GC_GENERATION_RANGE range;
+    return SUCCEEDED(lazyHeapProfiler->corProfilerInfo->GetObjectGeneration(address, &range));
 }
 
 CorProfiler::~CorProfiler()
@@ -42,10 +92,18 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
         COR_PRF_DISABLE_TRANSPARENCY_CHECKS_UNDER_FULL_TRUST | /* helps the case where this profiler is used on Full CLR */
         COR_PRF_DISABLE_INLINING |
         COR_PRF_MONITOR_GC |
-        COR_PRF_ENABLE_OBJECT_ALLOCATED |
-        COR_PRF_MONITOR_OBJECT_ALLOCATED |
+        COR_PRF_MONITOR_CLASS_LOADS |
+        COR_PRF_MONITOR_MODULE_LOADS |
+        COR_PRF_MONITOR_THREADS |
         COR_PRF_ENABLE_REJIT;
 
+    // NOTE: allocation callbacks slow down every allocation of the runtime, so in lazy heap mode objects are
+    //       registered only when they are first seen by probes
+    const char *lazyHeapEnvVar = getenv("CONCOLIC_LAZY_HEAP");
+    lazyHeap = lazyHeapEnvVar && strcmp(lazyHeapEnvVar, "1") == 0;
+    if (!lazyHeap)
+        eventMask |= COR_PRF_ENABLE_OBJECT_ALLOCATED | COR_PRF_MONITOR_OBJECT_ALLOCATED;
+
     // TODO: place IfFailRet here, log fails!
     auto hr = this->corProfilerInfo->SetEventMask(eventMask);
 
@@ -53,6 +111,17 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
     open_log();
 #endif
 
+    // NOTE: shadow memory replaces lookups of per-object bitmaps with direct address arithmetic
+    const char *shadowMemoryEnvVar = getenv("CONCOLIC_SHADOW_MEMORY");
+    if (shadowMemoryEnvVar && strcmp(shadowMemoryEnvVar, "1") == 0 && !heap.enableShadowMemory()) {
+        LOG_ERROR(tout << "unable to reserve shadow memory, per-object bitmaps are used");
+    }
+
+    // NOTE: period of heap statistics reports in commands, reports are disabled by default
+    const char *heapStatsEnvVar = getenv("CONCOLIC_HEAP_STATS");
+    if (heapStatsEnvVar)
+        heapStatsPeriod = (unsigned) strtoul(heapStatsEnvVar, nullptr, 10);
+
     auto currentThreadGetter = [=]() {
         ThreadID result;
         HRESULT hr = corProfilerInfo->GetCurrentThreadID(&result);
@@ -63,6 +132,12 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
     };
     currentThread = currentThreadGetter;
 
+    if (lazyHeap) {
+        lazyHeapProfiler = this;
+        lazyObjectRegistrar = &CorProfiler::registerSeenObject;
+        lazyHeapContains = &CorProfiler::gcHeapContains;
+    }
+
     protocol = new vsharp::Protocol();
     if (!protocol->startSession()) return E_FAIL;
 
@@ -165,8 +240,16 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ModuleUnloadStarted(ModuleID moduleId)
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ModuleUnloadFinished(ModuleID moduleId, HRESULT hrStatus)
 {
-    UNUSED(moduleId);
     UNUSED(hrStatus);
+    std::lock_guard<std::mutex> lock(typeDescriptorsLock);
+    std::vector<ClassID> unloaded;
+    for (const auto &entry : typeDescriptors) {
+        const std::vector<ModuleID> &modules = entry.second.modules;
+        if (std::find(modules.begin(), modules.end(), moduleId) != modules.end())
+            unloaded.push_back(entry.first);
+    }
+    if (!unloaded.empty())
+        releaseTypeDescriptors(unloaded);
     return S_OK;
 }
 
@@ -198,8 +281,10 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ClassUnloadStarted(ClassID classId)
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ClassUnloadFinished(ClassID classId, HRESULT hrStatus)
 {
-    UNUSED(classId);
     UNUSED(hrStatus);
+    std::lock_guard<std::mutex> lock(typeDescriptorsLock);
+    if (typeDescriptors.count(classId))
+        releaseTypeDescriptors({classId});
     return S_OK;
 }
 
@@ -269,13 +354,13 @@ HRESULT STDMETHODCALLTYPE CorProfiler::JITInlining(FunctionID callerId, Function
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ThreadCreated(ThreadID threadId)
 {
-    UNUSED(threadId);
+    threadCreated(threadId);
     return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ThreadDestroyed(ThreadID threadId)
 {
-    UNUSED(threadId);
+    threadDestroyed(threadId);
     return S_OK;
 }
 
@@ -386,13 +471,38 @@ HRESULT STDMETHODCALLTYPE CorProfiler::RuntimeThreadResumed(ThreadID threadId)
     return S_OK;
 }
 
-HRESULT STDMETHODCALLTYPE CorProfiler::MovedReferences(ULONG cMovedObjectIDRanges, ObjectID oldObjectIDRangeStart[], ObjectID newObjectIDRangeStart[], ULONG cObjectIDRangeLength[])
+template<typename Length>
+void moveReferences(ULONG count, const ObjectID oldStarts[], const ObjectID newStarts[], const Length lengths[])
 {
-    for (int i = 0; i < cMovedObjectIDRanges; ++i) {
-        heap.moveAndMark(oldObjectIDRangeStart[i], newObjectIDRangeStart[i], cObjectIDRangeLength[i]);
+    std::vector<std::pair<Interval, Shift>> moves;
+    moves.reserve(count);
+    for (ULONG i = 0; i < count; ++i) {
+        if (lengths[i] == 0) continue;
+        moves.emplace_back(Interval(oldStarts[i], lengths[i]), Shift{oldStarts[i], newStarts[i]});
     }
+    heap.moveAndMark(moves);
+}
+
+template<typename Length>
+void markSurvivingReferences(ULONG count, const ObjectID starts[], const Length lengths[])
+{
+    std::vector<Interval> survived;
+    survived.reserve(count);
+    for (ULONG i = 0; i < count; ++i) {
+        if (lengths[i] == 0) continue;
+        survived.emplace_back(starts[i], lengths[i]);
+    }
+    heap.markSurvivedObjects(survived);
+}
+
+HRESULT STDMETHODCALLTYPE CorProfiler::MovedReferences(ULONG cMovedObjectIDRanges, ObjectID oldObjectIDRangeStart[], ObjectID newObjectIDRangeStart[], ULONG cObjectIDRangeLength[])
+{
+    // NOTE: runtime reports the same ranges via MovedReferences2 first, if it succeeds
+    if (!sizeTRangesReported)
+        moveReferences(cMovedObjectIDRanges, oldObjectIDRangeStart, newObjectIDRangeStart, cObjectIDRangeLength);
     return S_OK;
 }
+
 bool corElementTypeIsPrimitive(CorElementType corElementType) {
     switch (corElementType) {
         case ELEMENT_TYPE_BOOLEAN:
@@ -416,7 +526,7 @@ bool corElementTypeIsPrimitive(CorElementType corElementType) {
 }
 
 // TODO: use tree of type and store it in the heap
-void CorProfiler::resolveType(ClassID classId, std::vector<bool> &isValid, std::vector<bool> &isArray, std::vector<std::pair<CorElementType, int>> &arrayTypes, std::vector<mdTypeDef> &tokens, std::vector<int> &typeArgsCount, std::vector<WCHAR> &moduleNames, std::vector<int> &moduleSizes, std::vector<WCHAR> &assemblyNames, std::vector<int> &assemblySizes)
+void CorProfiler::resolveType(ClassID classId, std::vector<bool> &isValid, std::vector<bool> &isArray, std::vector<std::pair<CorElementType, int>> &arrayTypes, std::vector<mdTypeDef> &tokens, std::vector<int> &typeArgsCount, std::vector<WCHAR> &moduleNames, std::vector<int> &moduleSizes, std::vector<WCHAR> &assemblyNames, std::vector<int> &assemblySizes, std::vector<ModuleID> &moduleIds)
 {
     CorElementType corElementType;
     ClassID elementType;
@@ -427,7 +537,7 @@ void CorProfiler::resolveType(ClassID classId, std::vector<bool> &isValid, std::
         isArray.push_back(true);
         arrayTypes.emplace_back(corElementType, rank);
         if (!corElementTypeIsPrimitive(corElementType)) {
-            resolveType(elementType, isValid, isArray, arrayTypes, tokens, typeArgsCount, moduleNames, moduleSizes, assemblyNames, assemblySizes);
+            resolveType(elementType, isValid, isArray, arrayTypes, tokens, typeArgsCount, moduleNames, moduleSizes, assemblyNames, assemblySizes, moduleIds);
         }
     } else {
         ModuleID moduleId;
@@ -445,6 +555,7 @@ void CorProfiler::resolveType(ClassID classId, std::vector<bool> &isValid, std::
             if (FAILED(this->corProfilerInfo->GetClassIDInfo2(classId, &moduleId, &token, &parent, typeArgsNum, &typeArgsNum, typeArgs))) FAIL_LOUD("getting generic type info failed!");
             tokens.push_back(token);
             typeArgsCount.push_back((int) typeArgsNum);
+            moduleIds.push_back(moduleId);
 
             LPCBYTE pBaseLoadAddress;
             ULONG moduleSize;
@@ -474,7 +585,7 @@ void CorProfiler::resolveType(ClassID classId, std::vector<bool> &isValid, std::
             delete[] assemblyName;
 
             for (int i = 0; i < typeArgsNum; ++i)
-                resolveType(typeArgs[i], isValid, isArray, arrayTypes, tokens, typeArgsCount, moduleNames, moduleSizes, assemblyNames, assemblySizes);
+                resolveType(typeArgs[i], isValid, isArray, arrayTypes, tokens, typeArgsCount, moduleNames, moduleSizes, assemblyNames, assemblySizes, moduleIds);
             delete[] typeArgs;
         } else {
             isValid.push_back(false);
@@ -483,7 +594,7 @@ void CorProfiler::resolveType(ClassID classId, std::vector<bool> &isValid, std::
 }
 
 // TODO: need to move serialize to probes?
-void CorProfiler::serializeType(const std::vector<bool> &isValid, const std::vector<bool> &isArray, const std::vector<std::pair<CorElementType, int>> &arrayTypes, const std::vector<mdTypeDef> &tokens, const std::vector<int> &typeArgsCount, const std::vector<WCHAR> &moduleNames, const std::vector<int> &moduleSizes, char *&type, unsigned long &typeLength, const std::vector<WCHAR>& assemblyNames, const std::vector<int>& assemblySizes)
+void CorProfiler::serializeType(const std::vector<bool> &isValid, const std::vector<bool> &isArray, const std::vector<std::pair<CorElementType, int>> &arrayTypes, const std::vector<mdTypeDef> &tokens, const std::vector<int> &typeArgsCount, const std::vector<WCHAR> &moduleNames, const std::vector<int> &moduleSizes, std::vector<char> &typeBytes, const std::vector<WCHAR>& assemblyNames, const std::vector<int>& assemblySizes)
 {
     auto isValidSize = (INT32)isValid.size();
     auto isArraySize = (INT32)isArray.size();
@@ -495,9 +606,9 @@ void CorProfiler::serializeType(const std::vector<bool> &isValid, const std::vec
     auto assemblyNamesSize = (INT32)assemblyNames.size();
     auto assemblySizesSize = (INT32)assemblySizes.size();
     assert(tokensSize == typeArgsCountSize && typeArgsCountSize == moduleSizesSize && moduleSizesSize == assemblySizesSize);
-    typeLength = isValidSize * sizeof(BYTE) + isArraySize * sizeof(BYTE) + arrayTypesSize * (sizeof(BYTE) + sizeof(INT32)) + tokensSize * sizeof(INT32) + typeArgsCountSize * sizeof(INT32) + moduleNamesSize * sizeof(WCHAR) + moduleSizesSize * sizeof(INT32) + assemblyNamesSize * sizeof(WCHAR) + assemblySizesSize * sizeof(INT32);
-    type = new char[typeLength];
-    char *begin = type;
+    unsigned long typeLength = isValidSize * sizeof(BYTE) + isArraySize * sizeof(BYTE) + arrayTypesSize * (sizeof(BYTE) + sizeof(INT32)) + tokensSize * sizeof(INT32) + typeArgsCountSize * sizeof(INT32) + moduleNamesSize * sizeof(WCHAR) + moduleSizesSize * sizeof(INT32) + assemblyNamesSize * sizeof(WCHAR) + assemblySizesSize * sizeof(INT32);
+    typeBytes.resize(typeLength);
+    char *type = typeBytes.data();
     auto moduleNamesPtr = (char *) moduleNames.data();
     auto assemblyNamesPtr = (char *) assemblyNames.data();
     int arrayTypeIndex = 0;
@@ -541,16 +652,35 @@ void CorProfiler::serializeType(const std::vector<bool> &isValid, const std::vec
         }
     }
     assert(tokenIndex == tokensSize && validObjectIndex == isArraySize);
-    type = begin;
+    assert((unsigned long) (type - typeBytes.data()) == typeLength);
 }
 
-HRESULT STDMETHODCALLTYPE CorProfiler::ObjectAllocated(ObjectID objectId, ClassID classId)
+struct LocalTypeDescriptors {
+    unsigned epoch;
+    std::unordered_map<ClassID, TypeDescriptor *> descriptors;
+};
+
+static thread_local LocalTypeDescriptors localTypeDescriptors;
+
+TypeDescriptor *CorProfiler::typeDescriptor(ClassID classId)
 {
-    ULONG size;
-    this->corProfilerInfo->GetObjectSize(objectId, &size);
+    unsigned epoch = typeDescriptorsEpoch.load(std::memory_order_acquire);
+    if (localTypeDescriptors.epoch != epoch) {
+        localTypeDescriptors.descriptors.clear();
+        localTypeDescriptors.epoch = epoch;
+    }
+    TypeDescriptor *&local = localTypeDescriptors.descriptors[classId];
+    if (!local)
+        local = sharedTypeDescriptor(classId);
+    return local;
+}
 
-    char *type = new char[0];
-    unsigned long typeLength = 0;
+TypeDescriptor *CorProfiler::sharedTypeDescriptor(ClassID classId)
+{
+    std::lock_guard<std::mutex> lock(typeDescriptorsLock);
+    auto it = typeDescriptors.find(classId);
+    if (it != typeDescriptors.end())
+        return it->second.descriptor.get();
 
     std::vector<bool> isValid;
     std::vector<bool> isArray;
@@ -561,10 +691,59 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ObjectAllocated(ObjectID objectId, ClassI
     std::vector<int> nameLengths;
     std::vector<WCHAR> assemblyNames;
     std::vector<int> assemblySizes;
-    resolveType(classId, isValid, isArray, arrayTypes, tokens, typeArgsCount, moduleNames, nameLengths, assemblyNames, assemblySizes);
-    serializeType(isValid, isArray, arrayTypes, tokens, typeArgsCount, moduleNames, nameLengths, type, typeLength, assemblyNames, assemblySizes);
+    std::vector<ModuleID> moduleIds;
+    resolveType(classId, isValid, isArray, arrayTypes, tokens, typeArgsCount, moduleNames, nameLengths, assemblyNames, assemblySizes, moduleIds);
+    CachedType &cached = typeDescriptors[classId];
+    cached.descriptor.reset(new TypeDescriptor());
+    cached.modules = std::move(moduleIds);
+    TypeDescriptor *type = cached.descriptor.get();
+    serializeType(isValid, isArray, arrayTypes, tokens, typeArgsCount, moduleNames, nameLengths, type->bytes, assemblyNames, assemblySizes);
+    return type;
+}
+
+void CorProfiler::releaseTypeDescriptors(const std::vector<ClassID> &classIds)
+{
+    // NOTE: heap forgets released types before they are freed, and thread-local caches drop them after epoch change
+    std::vector<const TypeDescriptor *> released;
+    for (ClassID classId : classIds)
+        released.push_back(typeDescriptors[classId].descriptor.get());
+    heap.forgetTypes(released);
+    ++typeDescriptorsEpoch;
+    for (ClassID classId : classIds)
+        typeDescriptors.erase(classId);
+}
+
+struct Gen0Range {
+    ADDR start;
+    ADDR end;
+    unsigned gcEpoch;
+};
+
+static thread_local Gen0Range allocationGen0Range{0, 0, 0};
+
+int CorProfiler::allocationGeneration(ObjectID objectId, ULONG size)
+{
+    // NOTE: small objects are allocated in gen0, until GC moves its bounds, so runtime is asked only for objects out
+    //       of gen0 range, cached by thread. Threshold only saves lookups of cache, configured one may be larger
+    unsigned epoch = gcEpoch.load(std::memory_order_acquire);
+    const Gen0Range &cached = allocationGen0Range;
+    if (size < largeObjectSize && cached.gcEpoch == epoch && cached.start <= objectId && objectId < cached.end)
+        return 0;
+    // NOTE: runtime reports no generation for objects of frozen segments
+    COR_PRF_GC_GENERATION_RANGE range;
+    if (FAILED(this->corProfilerInfo->GetObjectGeneration(objectId, &range)))
+        return Heap::frozenGeneration;
+    if (range.generation == COR_PRF_GC_GEN_0)
+        allocationGen0Range = {range.rangeStart, range.rangeStart + range.rangeLengthReserved, epoch};
+    return (int) range.generation;
+}
 
-    heap.allocateObject(objectId, size, type, typeLength);
+HRESULT STDMETHODCALLTYPE CorProfiler::ObjectAllocated(ObjectID objectId, ClassID classId)
+{
+    ULONG size;
+    this->corProfilerInfo->GetObjectSize(objectId, &size);
+    // NOTE: large, pinned and frozen objects are never moved by ephemeral GCs, so heap indexes them apart
+    heap.registerObject(objectId, size, typeDescriptor(classId), allocationGeneration(objectId, size));
     return S_OK;
 }
 
@@ -785,22 +964,38 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ThreadNameChanged(ThreadID threadId, ULON
 
 HRESULT STDMETHODCALLTYPE CorProfiler::GarbageCollectionStarted(int cGenerations, BOOL generationCollected[], COR_PRF_GC_REASON reason)
 {
-    UNUSED(cGenerations);
-    UNUSED(generationCollected);
     UNUSED(reason);
+    readGenerationBounds();
+    heap.startGC(cGenerations, generationCollected, generationBounds);
     return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::SurvivingReferences(ULONG cSurvivingObjectIDRanges, ObjectID objectIDRangeStart[], ULONG cObjectIDRangeLength[])
 {
-    for (int i = 0; i < cSurvivingObjectIDRanges; ++i)
-        heap.markSurvivedObjects(objectIDRangeStart[i], cObjectIDRangeLength[i]);
+    // NOTE: runtime reports the same ranges via SurvivingReferences2 first, if it succeeds
+    if (!sizeTRangesReported)
+        markSurvivingReferences(cSurvivingObjectIDRanges, objectIDRangeStart, cObjectIDRangeLength);
     return S_OK;
 }
 
+void CorProfiler::readGenerationBounds()
+{
+    ULONG count = 0;
+    generationBounds.clear();
+    if (FAILED(corProfilerInfo->GetGenerationBounds(0, &count, nullptr)))
+        return;
+    generationBounds.resize(count);
+    if (FAILED(corProfilerInfo->GetGenerationBounds(count, &count, generationBounds.data())))
+        count = 0;
+    generationBounds.resize(count);
+}
+
 HRESULT STDMETHODCALLTYPE CorProfiler::GarbageCollectionFinished()
 {
-    heap.clearAfterGC();
+    // NOTE: if bounds could not be read, heap assumes that survivors are promoted
+    readGenerationBounds();
+    heap.clearAfterGC(generationBounds);
+    gcEpoch.fetch_add(1, std::memory_order_release);
     return S_OK;
 }
 
@@ -888,18 +1083,15 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ReJITError(ModuleID moduleId, mdMethodDef
 
 HRESULT STDMETHODCALLTYPE CorProfiler::MovedReferences2(ULONG cMovedObjectIDRanges, ObjectID oldObjectIDRangeStart[], ObjectID newObjectIDRangeStart[], SIZE_T cObjectIDRangeLength[])
 {
-    UNUSED(cMovedObjectIDRanges);
-    UNUSED(oldObjectIDRangeStart);
-    UNUSED(newObjectIDRangeStart);
-    UNUSED(cObjectIDRangeLength);
+    sizeTRangesReported = true;
+    moveReferences(cMovedObjectIDRanges, oldObjectIDRangeStart, newObjectIDRangeStart, cObjectIDRangeLength);
     return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::SurvivingReferences2(ULONG cSurvivingObjectIDRanges, ObjectID objectIDRangeStart[], SIZE_T cObjectIDRangeLength[])
 {
-    UNUSED(cSurvivingObjectIDRanges);
-    UNUSED(objectIDRangeStart);
-    UNUSED(cObjectIDRangeLength);
+    sizeTRangesReported = true;
+    markSurvivingReferences(cSurvivingObjectIDRanges, objectIDRangeStart, cObjectIDRangeLength);
     return S_OK;
 }
 
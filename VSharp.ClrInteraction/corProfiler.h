@@ -2,6 +2,9 @@
 #define CORPROFILER_H_
 
 #include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include "memory/heap.h"
 #include "cor.h"
 #include "corprof.h"
@@ -18,9 +21,40 @@ private:
     ICorProfilerInfo8 *corProfilerInfo;
     Instrumenter *instrumenter;
     Protocol *protocol;
+    // NOTE: set, when runtime reports GC ranges via SIZE_T callbacks, so that ULONG ones are skipped
+    bool sizeTRangesReported;
+    // NOTE: GC callbacks are not reentrant, so buffer for generation ranges is shared by them
+    std::vector<COR_PRF_GC_GENERATION_RANGE> generationBounds;
 
-    void resolveType(ClassID classId, std::vector<bool> &isValid, std::vector<bool> &isArray, std::vector<std::pair<CorElementType, int>> &arrayTypes, std::vector<mdTypeDef> &tokens, std::vector<int> &typeArgsCount, std::vector<WCHAR> &moduleNames, std::vector<int> &moduleSizes, std::vector<WCHAR> &assemblyNames, std::vector<int> &assemblySizes);
-    void serializeType(const std::vector<bool> &isValid, const std::vector<bool> &isArray, const std::vector<std::pair<CorElementType, int>> &arrayTypes, const std::vector<mdTypeDef> &tokens, const std::vector<int> &typeArgsCount, const std::vector<WCHAR> &moduleNames, const std::vector<int> &moduleSizes, char *&type, unsigned long &typeLength, const std::vector<WCHAR>& assemblyNames, const std::vector<int>& assemblySizes);
+    void readGenerationBounds();
+    // NOTE: objects of this size are allocated in large object heap, threshold is configured for runtime as well
+    SIZE largeObjectSize;
+    // NOTE: incremented after each GC, so that gen0 ranges, cached by allocating threads, are dropped
+    std::atomic<unsigned> gcEpoch;
+
+    int allocationGeneration(ObjectID objectId, ULONG size);
+    // NOTE: types of allocated objects are resolved and serialized once per class. Descriptors are released, when
+    //       their class or any module, which resolved type refers to via element or generic arguments, is unloaded.
+    //       Allocating threads look up thread-local copies of the cache, which are dropped when epoch changes
+    struct CachedType {
+        std::unique_ptr<TypeDescriptor> descriptor;
+        std::vector<ModuleID> modules;
+    };
+    std::unordered_map<ClassID, CachedType> typeDescriptors;
+    std::mutex typeDescriptorsLock;
+    std::atomic<unsigned> typeDescriptorsEpoch;
+
+    // NOTE: probes call registrar of lazy heap via plain function pointer, so it finds profiler here
+    static CorProfiler *lazyHeapProfiler;
+    static void registerSeenObject(INT_PTR ref);
+    static bool gcHeapContains(INT_PTR address);
+
+    TypeDescriptor *sharedTypeDescriptor(ClassID classId);
+    TypeDescriptor *typeDescriptor(ClassID classId);
+    void releaseTypeDescriptors(const std::vector<ClassID> &classIds);
+
+    void resolveType(ClassID classId, std::vector<bool> &isValid, std::vector<bool> &isArray, std::vector<std::pair<CorElementType, int>> &arrayTypes, std::vector<mdTypeDef> &tokens, std::vector<int> &typeArgsCount, std::vector<WCHAR> &moduleNames, std::vector<int> &moduleSizes, std::vector<WCHAR> &assemblyNames, std::vector<int> &assemblySizes, std::vector<ModuleID> &moduleIds);
+    void serializeType(const std::vector<bool> &isValid, const std::vector<bool> &isArray, const std::vector<std::pair<CorElementType, int>> &arrayTypes, const std::vector<mdTypeDef> &tokens, const std::vector<int> &typeArgsCount, const std::vector<WCHAR> &moduleNames, const std::vector<int> &moduleSizes, std::vector<char> &typeBytes, const std::vector<WCHAR>& assemblyNames, const std::vector<int>& assemblySizes);
 
 public:
     CorProfiler();
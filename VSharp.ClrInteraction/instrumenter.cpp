@@ -36,10 +36,11 @@ struct MethodBodyInfo {
     const char *bytecode;
     const char *ehs;
 
-    void serialize(char *&bytes, unsigned &count) const {
-        count = codeLength + 6 * sizeof(unsigned) + ehsLength + assemblyNameLength + moduleNameLength + signatureTokensLength;
-        bytes = new char[count];
-        char *buffer = bytes;
+    size_t serializedSize() const {
+        return codeLength + 6 * sizeof(unsigned) + ehsLength + assemblyNameLength + moduleNameLength + signatureTokensLength;
+    }
+
+    void serialize(char *&buffer) const {
         unsigned size = sizeof(unsigned);
         *(unsigned *)buffer = token; buffer += size;
         *(unsigned *)buffer = codeLength; buffer += size;
@@ -57,6 +58,7 @@ struct MethodBodyInfo {
         memcpy(buffer, bytecode, size);
         buffer += size; size = ehsLength;
         memcpy(buffer, ehs, size);
+        buffer += size;
     }
 };
 
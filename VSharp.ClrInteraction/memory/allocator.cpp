@@ -0,0 +1,107 @@
+#include "allocator.h"
+#include <cassert>
+
+using namespace vsharp;
+
+// --------------------------- FixedSizePool ---------------------------
+
+FixedSizePool::FixedSizePool(size_t blockSize, size_t slabSize)
+    : m_blockSize(blockSize < sizeof(void *) ? sizeof(void *) : blockSize)
+    , m_slabSize(slabSize < blockSize ? blockSize : slabSize)
+    , m_freeList(nullptr)
+    , m_bump(nullptr)
+    , m_bumpEnd(nullptr)
+{
+    // NOTE: keeping blocks suitably aligned for any object
+    m_blockSize = (m_blockSize + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+}
+
+FixedSizePool::~FixedSizePool()
+{
+    for (char *slab : m_slabs)
+        delete[] slab;
+}
+
+void FixedSizePool::newSlab()
+{
+    size_t blocksCount = m_slabSize / m_blockSize;
+    char *slab = new char[blocksCount * m_blockSize];
+    m_slabs.push_back(slab);
+    m_bump = slab;
+    m_bumpEnd = slab + blocksCount * m_blockSize;
+}
+
+void *FixedSizePool::allocate()
+{
+    if (m_freeList) {
+        void *block = m_freeList;
+        m_freeList = *(void **) block;
+        return block;
+    }
+    if (m_bump == m_bumpEnd)
+        newSlab();
+    void *block = m_bump;
+    m_bump += m_blockSize;
+    return block;
+}
+
+void FixedSizePool::release(void *block)
+{
+    assert(block);
+    *(void **) block = m_freeList;
+    m_freeList = block;
+}
+
+// --------------------------- SlabAllocator ---------------------------
+
+SlabAllocator::SlabAllocator()
+    : m_allocated(0)
+{
+    for (size_t i = 0; i < classesCount; ++i)
+        m_pools[i] = new FixedSizePool(minClassSize << i);
+}
+
+SlabAllocator::~SlabAllocator()
+{
+    for (FixedSizePool *pool : m_pools)
+        delete pool;
+}
+
+size_t SlabAllocator::sizeClass(size_t size)
+{
+    size_t result = 0;
+    size_t classSize = minClassSize;
+    while (classSize < size) {
+        classSize <<= 1;
+        ++result;
+    }
+    return result;
+}
+
+void *SlabAllocator::allocate(size_t size)
+{
+    size_t c = sizeClass(size);
+    if (c < classesCount) {
+        m_allocated += minClassSize << c;
+        return m_pools[c]->allocate();
+    }
+    m_allocated += size;
+    return new char[size];
+}
+
+void SlabAllocator::release(void *block, size_t size)
+{
+    size_t c = sizeClass(size);
+    if (c < classesCount) {
+        m_allocated -= minClassSize << c;
+        m_pools[c]->release(block);
+    } else {
+        m_allocated -= size;
+        delete[] (char *) block;
+    }
+}
+
+size_t SlabAllocator::allocatedBytes() const
+{
+    return m_allocated;
+}
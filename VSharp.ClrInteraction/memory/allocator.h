@@ -0,0 +1,57 @@
+#ifndef ALLOCATOR_H_
+#define ALLOCATOR_H_
+
+#include <cstddef>
+#include <vector>
+
+namespace vsharp {
+
+// NOTE: pool of equally sized blocks, carved from large slabs. Released blocks are linked into intrusive free list
+//       and reused by next allocations, slabs are returned to the system only when pool is destroyed.
+class FixedSizePool {
+private:
+    size_t m_blockSize;
+    size_t m_slabSize;
+    std::vector<char *> m_slabs;
+    void *m_freeList;
+    char *m_bump;
+    char *m_bumpEnd;
+
+    void newSlab();
+
+public:
+    explicit FixedSizePool(size_t blockSize, size_t slabSize = 64 * 1024);
+    FixedSizePool(const FixedSizePool &other) = delete;
+    FixedSizePool &operator=(const FixedSizePool &other) = delete;
+    ~FixedSizePool();
+
+    void *allocate();
+    void release(void *block);
+};
+
+// NOTE: size-classed allocator: requests are rounded up to powers of two and served by pools of corresponding size.
+//       Requests larger than the largest class go directly to the system allocator.
+class SlabAllocator {
+private:
+    static const size_t minClassSize = 8;
+    static const size_t classesCount = 10;
+    FixedSizePool *m_pools[classesCount];
+    size_t m_allocated;
+
+    static size_t sizeClass(size_t size);
+
+public:
+    SlabAllocator();
+    SlabAllocator(const SlabAllocator &other) = delete;
+    SlabAllocator &operator=(const SlabAllocator &other) = delete;
+    ~SlabAllocator();
+
+    void *allocate(size_t size);
+    void release(void *block, size_t size);
+    // NOTE: bytes of blocks in use, including rounding to size classes
+    size_t allocatedBytes() const;
+};
+
+}
+
+#endif // ALLOCATOR_H_
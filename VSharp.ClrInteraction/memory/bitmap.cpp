@@ -0,0 +1,130 @@
+#include "bitmap.h"
+#include <cstring>
+
+#ifdef VECTORIZED_BITMAPS
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace vsharp;
+
+static const cell ones = ~(cell) 0;
+
+bool vsharp::allOnesScalar(const cell *words, UINT_PTR count)
+{
+    UINT_PTR i = 0;
+    for (; i + 4 <= count; i += 4) {
+        if ((words[i] & words[i + 1] & words[i + 2] & words[i + 3]) != ones)
+            return false;
+    }
+    for (; i < count; ++i) {
+        if (words[i] != ones)
+            return false;
+    }
+    return true;
+}
+
+#ifdef VECTORIZED_BITMAPS
+
+bool vsharp::allOnesSSE2(const cell *words, UINT_PTR count)
+{
+    UINT_PTR i = 0;
+    const __m128i allSet = _mm_set1_epi32(-1);
+    for (; i + 4 <= count; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (words + i));
+        __m128i y = _mm_loadu_si128((const __m128i *) (words + i + 2));
+        __m128i eq = _mm_cmpeq_epi32(_mm_and_si128(x, y), allSet);
+        if (_mm_movemask_epi8(eq) != 0xFFFF)
+            return false;
+    }
+    return allOnesScalar(words + i, count - i);
+}
+
+__attribute__((target("avx2")))
+bool vsharp::allOnesAVX2(const cell *words, UINT_PTR count)
+{
+    UINT_PTR i = 0;
+    const __m256i allSet = _mm256_set1_epi32(-1);
+    for (; i + 8 <= count; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (words + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *) (words + i + 4));
+        if (!_mm256_testc_si256(_mm256_and_si256(x, y), allSet))
+            return false;
+    }
+    return allOnesScalar(words + i, count - i);
+}
+
+#endif
+
+typedef bool (*AllOnesKernel)(const cell *, UINT_PTR);
+
+static AllOnesKernel chooseAllOnesKernel()
+{
+#ifdef VECTORIZED_BITMAPS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return allOnesAVX2;
+    return allOnesSSE2;
+#else
+    return allOnesScalar;
+#endif
+}
+
+static const AllOnesKernel allOnesKernel = chooseAllOnesKernel();
+
+bool vsharp::allOnes(const cell *words, UINT_PTR count)
+{
+    return allOnesKernel(words, count);
+}
+
+// NOTE: edge words may be shared with concurrent writes to neighbouring bytes, so they are updated atomically
+static inline void setMasked(cell *word, cell mask, bool value)
+{
+#ifdef _MSC_VER
+    if (value)
+        _InterlockedOr64((volatile __int64 *) word, (__int64) mask);
+    else
+        _InterlockedAnd64((volatile __int64 *) word, (__int64) ~mask);
+#else
+    if (value)
+        __atomic_fetch_or(word, mask, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_and(word, ~mask, __ATOMIC_RELAXED);
+#endif
+}
+
+bool vsharp::testBits(const cell *bits, UINT_PTR from, UINT_PTR to)
+{
+    if (from >= to)
+        return true;
+    UINT_PTR first = from / cellBits;
+    UINT_PTR last = (to - 1) / cellBits;
+    cell firstMask = ones << (from % cellBits);
+    cell lastMask = ones >> (cellBits - 1 - (to - 1) % cellBits);
+    if (first == last)
+        return (bits[first] & firstMask & lastMask) == (firstMask & lastMask);
+    if ((bits[first] & firstMask) != firstMask || (bits[last] & lastMask) != lastMask)
+        return false;
+    return allOnes(bits + first + 1, last - first - 1);
+}
+
+void vsharp::setBits(cell *bits, UINT_PTR from, UINT_PTR to, bool value)
+{
+    if (from >= to)
+        return;
+    UINT_PTR first = from / cellBits;
+    UINT_PTR last = (to - 1) / cellBits;
+    cell firstMask = ones << (from % cellBits);
+    cell lastMask = ones >> (cellBits - 1 - (to - 1) % cellBits);
+    if (first == last)
+        firstMask &= lastMask;
+    setMasked(bits + first, firstMask, value);
+    if (first == last)
+        return;
+    if (last - first > 1)
+        memset(bits + first + 1, value ? 0xFF : 0x00, (last - first - 1) * sizeof(cell));
+    setMasked(bits + last, lastMask, value);
+}
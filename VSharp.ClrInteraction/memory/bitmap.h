@@ -0,0 +1,33 @@
+#ifndef BITMAP_H_
+#define BITMAP_H_
+
+#include "cor.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define VECTORIZED_BITMAPS
+#endif
+
+namespace vsharp {
+
+// NOTE: bitmaps are arrays of 64-bit words, bit i of the bitmap is bit (i % 64) of word (i / 64)
+typedef UINT64 cell;
+
+const UINT_PTR cellBits = sizeof(cell) * 8;
+
+// Checks if all bits in [from, to) are set
+bool testBits(const cell *bits, UINT_PTR from, UINT_PTR to);
+// Sets all bits in [from, to) to value
+void setBits(cell *bits, UINT_PTR from, UINT_PTR to, bool value);
+// Checks if all of 'count' words are filled with ones; uses the widest vector instructions, available at startup
+bool allOnes(const cell *words, UINT_PTR count);
+
+// NOTE: kernels of 'allOnes' are exposed for differential tests; AVX2 one must be called only if CPU supports it
+bool allOnesScalar(const cell *words, UINT_PTR count);
+#ifdef VECTORIZED_BITMAPS
+bool allOnesSSE2(const cell *words, UINT_PTR count);
+bool allOnesAVX2(const cell *words, UINT_PTR count);
+#endif
+
+}
+
+#endif // BITMAP_H_
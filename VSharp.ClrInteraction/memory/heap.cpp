@@ -1,8 +1,19 @@
 #include <iostream>
 #include <algorithm>
 #include <string>
+#include <new>
+#include <cstring>
+#include <unordered_map>
 #include "heap.h"
 
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 #define max(a,b) (((a) > (b)) ? (a) : (b))
 
@@ -84,159 +95,1093 @@ namespace vsharp {
 
 // --------------------------- Object ---------------------------
 
-    Object::Object(ADDR address, SIZE size)
+    // NOTE: summary of block is recomputed from its bitmap, so concurrent writes to large objects are serialized
+    static const size_t summaryLocksCount = 16;
+    static std::mutex summaryLocks[summaryLocksCount];
+
+    Object::Object(ADDR address, SIZE size, OBJID id, UINT32 owner, RegionKind kind)
         : Interval(address, size)
+        , id(id)
+        , owner(owner)
+        , kind(kind)
     {
         assert(size > 0);
-        SIZE squashedSize = (size + sizeofCell - 1) / sizeofCell;
-        concreteness = new cell[squashedSize];
-        // NOTE: all contents are concrete at the beginning
-        for (int i = 0; i < squashedSize; ++i) concreteness[i] = max;
+        // NOTE: all contents are concrete at the beginning, so bitmap is allocated lazily on first symbolic write
     }
 
     Object::~Object() {
-        delete[] concreteness;
+        assert(!concreteness.load() && !summary.load());
+    }
+
+    SIZE Object::cellsCount() const {
+        return (right - left + cellBits) / cellBits;
+    }
+
+    SIZE Object::blocksCount() const {
+        return (cellsCount() + blockCells - 1) / blockCells;
+    }
+
+    SIZE Object::summaryCellsCount() const {
+        return (blocksCount() + cellBits - 1) / cellBits;
+    }
+
+    bool Object::hasConcreteness() const {
+        return concreteness.load(std::memory_order_acquire) != nullptr;
+    }
+
+    void Object::allocateConcreteness(SlabAllocator &allocator) {
+        assert(!hasConcreteness());
+        // NOTE: summary is published before bitmap, so readers, which see bitmap, see summary as well
+        if (cellsCount() > summaryThreshold) {
+            SIZE bytesCount = summaryCellsCount() * sizeof(cell);
+            auto *bits = (cell *) allocator.allocate(bytesCount);
+            memset(bits, 0xFF, bytesCount);
+            summary.store(bits, std::memory_order_release);
+        }
+        SIZE bytesCount = cellsCount() * sizeof(cell);
+        auto *bits = (cell *) allocator.allocate(bytesCount);
+        memset(bits, 0xFF, bytesCount);
+        concreteness.store(bits, std::memory_order_release);
+    }
+
+    void Object::releaseConcreteness(SlabAllocator &allocator) {
+        if (cell *bits = summary.exchange(nullptr))
+            allocator.release(bits, summaryCellsCount() * sizeof(cell));
+        if (cell *bits = concreteness.exchange(nullptr))
+            allocator.release(bits, cellsCount() * sizeof(cell));
     }
 
     std::string Object::toString() const {
         return Interval::toString();
     }
 
+    bool Object::blockIsConcrete(const cell *bits, SIZE block) const {
+        // NOTE: bits after the end of object are never cleared, so whole cells can be checked
+        SIZE first = block * blockCells;
+        return allOnes(bits + first, min(first + blockCells, cellsCount()) - first);
+    }
+
     bool Object::read(SIZE offset, SIZE size) const {
         assert(size > 0);
-        auto startOffset = offset % sizeofCell;
-        auto startIndex = offset / sizeofCell;
-        auto endOffset = (offset + size) % sizeofCell;
-        auto endIndex = (offset + size) / sizeofCell;
-        for (unsigned i = startIndex + (startOffset ? 1 : 0); i < endIndex; ++i) {
-            if (!(concreteness[i] == max)) {
+        const cell *bits = concreteness.load(std::memory_order_acquire);
+        if (!bits)
+            return true;
+        SIZE end = offset + size;
+        const cell *blocks = summary.load(std::memory_order_relaxed);
+        if (!blocks)
+            return testBits(bits, offset, end);
+        // NOTE: blocks, marked in summary as fully concrete, are skipped without touching the bitmap
+        SIZE firstBlock = offset / blockSize;
+        SIZE lastBlock = (end - 1) / blockSize;
+        if (testBits(blocks, firstBlock, lastBlock + 1))
+            return true;
+        for (SIZE block = firstBlock; block <= lastBlock; ++block) {
+            if (testBits(blocks, block, block + 1))
+                continue;
+            SIZE from = max(offset, block * blockSize);
+            SIZE to = min(end, (block + 1) * blockSize);
+            if (!testBits(bits, from, to))
                 return false;
+        }
+        return true;
+    }
+
+    void Object::write(SIZE offset, SIZE size, bool vConcreteness) {
+        assert(size > 0);
+        cell *bits = concreteness.load(std::memory_order_acquire);
+        if (!bits) {
+            assert(vConcreteness);
+            return;
+        }
+        SIZE end = offset + size;
+        cell *blocks = summary.load(std::memory_order_relaxed);
+        if (!blocks) {
+            setBits(bits, offset, end, vConcreteness);
+            return;
+        }
+        std::lock_guard<std::mutex> lock(summaryLocks[id % summaryLocksCount]);
+        setBits(bits, offset, end, vConcreteness);
+        SIZE firstBlock = offset / blockSize;
+        SIZE lastBlock = (end - 1) / blockSize;
+        if (!vConcreteness) {
+            setBits(blocks, firstBlock, lastBlock + 1, false);
+            return;
+        }
+        // NOTE: blocks, covered by write entirely, become concrete; partially covered ones should be rechecked
+        setBits(blocks, firstBlock, lastBlock + 1, true);
+        setBits(blocks, firstBlock, firstBlock + 1, blockIsConcrete(bits, firstBlock));
+        if (lastBlock != firstBlock)
+            setBits(blocks, lastBlock, lastBlock + 1, blockIsConcrete(bits, lastBlock));
+    }
+
+// --------------------------- AllocationLog ---------------------------
+
+    static size_t varintSize(UINT32 value) {
+        size_t size = 1;
+        while (value >= 0x80) {
+            value >>= 7;
+            ++size;
+        }
+        return size;
+    }
+
+    static void writeVarint(UINT32 value, char *&buffer) {
+        while (value >= 0x80) {
+            *buffer++ = (char) ((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        *buffer++ = (char) value;
+    }
+
+    void AllocationLog::appendType(const TypeDescriptor *type) {
+        auto size = (UINT32) type->bytes.size();
+        const char *sizeBytes = (const char *) &size;
+        newTypes.insert(newTypes.end(), sizeBytes, sizeBytes + sizeof(UINT32));
+        newTypes.insert(newTypes.end(), type->bytes.begin(), type->bytes.end());
+        ++newTypesCount_;
+    }
+
+    void AllocationLog::append(OBJID id, UINT32 typeId) {
+        ids.push_back(id);
+        typeIds.push_back(typeId);
+        typeIdsSize += varintSize(typeId);
+    }
+
+    unsigned AllocationLog::count() const {
+        return (unsigned) ids.size();
+    }
+
+    unsigned AllocationLog::newTypesCount() const {
+        return newTypesCount_;
+    }
+
+    size_t AllocationLog::serializedSize() const {
+        return newTypes.size() + ids.size() * sizeof(OBJID) + typeIdsSize;
+    }
+
+    void AllocationLog::serialize(char *&buffer) const {
+        // NOTE: new types go first, in order of their ids, so that server appends them to its type table
+        if (!newTypes.empty()) {
+            memcpy(buffer, newTypes.data(), newTypes.size());
+            buffer += newTypes.size();
+        }
+        size_t size = ids.size() * sizeof(OBJID);
+        if (size) {
+            memcpy(buffer, ids.data(), size);
+            buffer += size;
+        }
+        for (UINT32 typeId : typeIds)
+            writeVarint(typeId, buffer);
+    }
+
+    void AllocationLog::clear() {
+        ids.clear();
+        typeIds.clear();
+        newTypes.clear();
+        newTypesCount_ = 0;
+        typeIdsSize = 0;
+    }
+
+// --------------------------- HeapStats ---------------------------
+
+    size_t HeapStats::serializedSize() const {
+        return (6 + 2 * generationsCount) * sizeof(UINT64);
+    }
+
+    void HeapStats::serialize(char *&buffer) const {
+        unsigned size = sizeof(UINT64);
+        *(UINT64 *)buffer = objectsCount; buffer += size;
+        *(UINT64 *)buffer = regionsCount; buffer += size;
+        *(UINT64 *)buffer = bitmapBytes; buffer += size;
+        *(UINT64 *)buffer = typeBytes; buffer += size;
+        *(UINT64 *)buffer = pendingNewObjects; buffer += size;
+        *(UINT64 *)buffer = pendingDeletedObjects; buffer += size;
+        size = generationsCount * sizeof(UINT64);
+        memcpy(buffer, gcCount, size); buffer += size;
+        memcpy(buffer, gcMicroseconds, size); buffer += size;
+    }
+
+    std::string HeapStats::toString() const {
+        std::string result = "objects: " + std::to_string(objectsCount) + ", regions: " + std::to_string(regionsCount)
+            + ", bitmaps: " + std::to_string(bitmapBytes) + " bytes, types: " + std::to_string(typeBytes)
+            + " bytes, pending: " + std::to_string(pendingNewObjects) + " new, "
+            + std::to_string(pendingDeletedObjects) + " deleted";
+        for (int i = 0; i < generationsCount; ++i)
+            result += ", gen" + std::to_string(i) + ": " + std::to_string(gcCount[i]) + " GCs, "
+                + std::to_string(gcMicroseconds[i]) + " us";
+        return result;
+    }
+
+// --------------------------- ResolveCache ---------------------------
+
+    // NOTE: per-thread direct-mapped cache of recently resolved objects. Objects never overlap and are removed
+    //       or moved only during GC, so entries stay valid until the heap epoch changes. Regions are dropped by probes
+    //       at any time, so entries of regions are also checked against objects table
+    struct ResolveCacheEntry {
+        ADDR left;
+        ADDR right;
+        unsigned heap;
+        Object *obj;
+        unsigned epoch;
+        OBJID id;
+        bool region;
+    };
+
+    static const size_t resolveCacheSize = 64;
+    // NOTE: neighbouring fields of one object fall into the same entry
+    static const int resolveCacheGranularity = 6;
+
+    struct ResolveCache {
+        ResolveCacheEntry lastHit;
+        ResolveCacheEntry entries[resolveCacheSize];
+    };
+
+    static thread_local ResolveCache resolveCache{};
+
+    static inline bool hits(const ResolveCacheEntry &entry, unsigned heap, unsigned epoch, ADDR address) {
+        return entry.obj && entry.heap == heap && entry.epoch == epoch && entry.left <= address && address <= entry.right;
+    }
+
+    static inline bool isLive(const ResolveCacheEntry &entry, const ObjectsTable &objects) {
+        if (!entry.region)
+            return true;
+        const Object *obj = objects.get(entry.id);
+        return obj == entry.obj && obj->left == entry.left && obj->right == entry.right;
+    }
+
+// --------------------------- ObjectsTable ---------------------------
+
+    ObjectsTable::ObjectsTable() {
+        for (auto &chunk : chunks)
+            chunk.store(nullptr, std::memory_order_relaxed);
+    }
+
+    ObjectsTable::~ObjectsTable() {
+        for (auto &chunk : chunks)
+            delete[] chunk.load(std::memory_order_relaxed);
+    }
+
+    void ObjectsTable::set(OBJID id, Object *obj) {
+        std::atomic<Object **> &chunk = chunks[id >> chunkBits];
+        Object **entries = chunk.load(std::memory_order_acquire);
+        if (!entries) {
+            std::lock_guard<std::mutex> lock(chunksLock);
+            entries = chunk.load(std::memory_order_relaxed);
+            if (!entries) {
+                entries = new Object *[chunkSize]();
+                chunk.store(entries, std::memory_order_release);
             }
         }
+        entries[id & (chunkSize - 1)] = obj;
+    }
+
+    Object *ObjectsTable::get(OBJID id) const {
+        Object **entries = chunks[id >> chunkBits].load(std::memory_order_acquire);
+        return entries ? entries[id & (chunkSize - 1)] : nullptr;
+    }
 
-        auto shift = sizeofCell - startOffset;
-        cell startMask = ((cell)1 << shift) - 1; // get 00..011...1
-        shift = sizeofCell - endOffset;
-        cell endMask = (max >> shift) << shift; // get 11..100..0
-        if (startOffset && ((concreteness[startIndex] & startMask) != startMask))
+// --------------------------- ShadowMemory ---------------------------
+
+    // NOTE: edge bytes may be shared with concurrent writes to neighbouring memory, so they are updated atomically
+    static inline void setMaskedByte(UINT8 *byte, UINT8 mask, bool symbolic) {
+#ifdef _MSC_VER
+        if (symbolic)
+            _InterlockedOr8((volatile char *) byte, (char) mask);
+        else
+            _InterlockedAnd8((volatile char *) byte, (char) ~mask);
+#else
+        if (symbolic)
+            __atomic_fetch_or(byte, mask, __ATOMIC_RELAXED);
+        else
+            __atomic_fetch_and(byte, (UINT8) ~mask, __ATOMIC_RELAXED);
+#endif
+    }
+
+    ShadowMemory::ShadowMemory()
+        : m_base(nullptr)
+        , m_size(0)
+    {
+    }
+
+    ShadowMemory::~ShadowMemory() {
+#ifndef WIN32
+        if (m_base)
+            munmap(m_base, m_size);
+#endif
+    }
+
+    bool ShadowMemory::reserve() {
+        assert(!m_base);
+#ifndef WIN32
+        // NOTE: user part of address space is 47 bits wide on 64-bit systems
+        const unsigned addressBits = sizeof(void *) == 8 ? 47 : 32;
+        SIZE size = (SIZE) 1 << (addressBits - 3);
+        void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED)
             return false;
-        if (endOffset && ((concreteness[endIndex] & endMask) != endMask))
+        m_base = (UINT8 *) base;
+        m_size = size;
+        return true;
+#else
+        // NOTE: reserved memory is committed explicitly on Windows, so per-object bitmaps are used there
+        return false;
+#endif
+    }
+
+    bool ShadowMemory::isReserved() const {
+        return m_base != nullptr;
+    }
+
+    bool ShadowMemory::read(ADDR address, SIZE size) const {
+        assert(size > 0 && (address + size - 1) / 8 < m_size);
+        ADDR last = address + size - 1;
+        const UINT8 *first = m_base + (address >> 3);
+        const UINT8 *end = m_base + (last >> 3);
+        auto firstMask = (UINT8) (0xFF << (address & 7));
+        auto lastMask = (UINT8) (0xFF >> (7 - (last & 7)));
+        if (first == end)
+            return (*first & firstMask & lastMask) == 0;
+        if ((*first & firstMask) || (*end & lastMask))
             return false;
+        for (const UINT8 *p = first + 1; p < end; ++p)
+            if (*p)
+                return false;
         return true;
     }
 
-    void Object::write(SIZE offset, SIZE size, bool vConcreteness) {
-        assert(size > 0);
-        auto startOffset = offset % sizeofCell;
-        auto startIndex = offset / sizeofCell;
-        auto endOffset = (offset + size) % sizeofCell;
-        auto endIndex = (offset + size) / sizeofCell;
-        for (unsigned i = startIndex + (startOffset ? 1 : 0); i < endIndex; ++i)
-            this->concreteness[i] = vConcreteness ? max : min;
-
-        auto shift = sizeofCell - startOffset;
-        cell startMask = ((cell)1 << shift) - 1; // get 00..011...1
-        shift = sizeofCell - endOffset;
-        cell endMask = (max >> shift) << shift; // get 11..100..0
-        if (startOffset) {
-            if (vConcreteness)
-                this->concreteness[startIndex] |= startMask;
-            else
-                this->concreteness[startIndex] &= ~startMask;
+    void ShadowMemory::write(ADDR address, SIZE size, bool vConcreteness) {
+        // NOTE: concrete writes to concrete memory do not touch shadow, so that its zero pages stay uncommitted
+        if (vConcreteness && read(address, size))
+            return;
+        bool symbolic = !vConcreteness;
+        ADDR last = address + size - 1;
+        UINT8 *first = m_base + (address >> 3);
+        UINT8 *end = m_base + (last >> 3);
+        auto firstMask = (UINT8) (0xFF << (address & 7));
+        auto lastMask = (UINT8) (0xFF >> (7 - (last & 7)));
+        if (first == end) {
+            setMaskedByte(first, firstMask & lastMask, symbolic);
+            return;
         }
-        if (endOffset) {
-            if (vConcreteness)
-                this->concreteness[endIndex] |= endMask;
+        setMaskedByte(first, firstMask, symbolic);
+        if (end - first > 1)
+            memset(first + 1, symbolic ? 0xFF : 0x00, end - first - 1);
+        setMaskedByte(end, lastMask, symbolic);
+    }
+
+    void ShadowMemory::load(ADDR address, SIZE size, std::vector<UINT8> &bits) const {
+        const UINT8 *source = m_base + (address >> 3);
+        unsigned shift = address & 7;
+        SIZE bytesCount = (size + 7) / 8;
+        for (SIZE i = 0; i < bytesCount; ++i) {
+            auto byte = (UINT8) (source[i] >> shift);
+            if (shift)
+                byte |= (UINT8) (source[i + 1] << (8 - shift));
+            bits.push_back(byte);
+        }
+    }
+
+    void ShadowMemory::store(ADDR address, SIZE size, const UINT8 *bits) {
+        UINT8 *target = m_base + (address >> 3);
+        unsigned shift = address & 7;
+        for (SIZE i = 0; size > 0; ++i) {
+            SIZE count = min(size, (SIZE) 8);
+            auto mask = (UINT8) (count == 8 ? 0xFF : (1 << count) - 1);
+            auto byte = (UINT8) (bits[i] & mask);
+            target[i] = (UINT8) ((target[i] & ~(mask << shift)) | (byte << shift));
+            if (shift && (mask >> (8 - shift)))
+                target[i + 1] = (UINT8) ((target[i + 1] & ~(mask >> (8 - shift))) | (byte >> (8 - shift)));
+            size -= count;
+        }
+    }
+
+    void ShadowMemory::clear(ADDR address, SIZE size) {
+        if (size == 0)
+            return;
+        // NOTE: each shadow page covers 'pageSize * 8' bytes of memory
+        const SIZE coveredSize = pageSize * 8;
+        ADDR pagesLeft = (address + coveredSize - 1) / coveredSize * coveredSize;
+        ADDR pagesRight = (address + size) / coveredSize * coveredSize;
+#ifndef WIN32
+        if (pagesLeft < pagesRight && madvise(m_base + (pagesLeft >> 3), (pagesRight - pagesLeft) >> 3, MADV_DONTNEED) == 0) {
+            if (address < pagesLeft)
+                write(address, pagesLeft - address, true);
+            if (pagesRight < address + size)
+                write(pagesRight, address + size - pagesRight, true);
+            return;
+        }
+#endif
+        write(address, size, true);
+    }
+
+    void ShadowMemory::move(const std::vector<std::pair<Interval, Shift>> &moves, const std::vector<Interval> &freed) {
+        // NOTE: all sources are saved before the first store. Fully concrete ranges are not copied, their targets
+        //       are just cleared, so that shadow of concrete part of heap stays untouched
+        static const size_t concreteRange = (size_t) -1;
+        std::vector<UINT8> saved;
+        std::vector<size_t> starts;
+        starts.reserve(moves.size());
+        for (const auto &move : moves) {
+            const Interval &range = move.first;
+            SIZE size = range.right - range.left + 1;
+            if (read(range.left, size)) {
+                starts.push_back(concreteRange);
+                continue;
+            }
+            starts.push_back(saved.size());
+            load(range.left, size, saved);
+        }
+        for (const Interval &range : freed)
+            clear(range.left, range.right - range.left + 1);
+        for (size_t i = 0; i < moves.size(); ++i) {
+            const Interval &range = moves[i].first;
+            ADDR target = moves[i].second.move(range.left);
+            SIZE size = range.right - range.left + 1;
+            if (starts[i] == concreteRange)
+                write(target, size, true);
             else
-                this->concreteness[endIndex] &= ~endMask;
+                store(target, size, saved.data() + starts[i]);
         }
     }
 
+// --------------------------- AllocationBuffer ---------------------------
+
+    struct Heap::AllocationBuffer {
+        // NOTE: taken by owner thread on registration and by other threads, when they resolve or flush its objects
+        std::mutex lock;
+        const UINT32 index;
+        FixedSizePool objectsPool;
+        Intervals objects[generationsCount];
+        Intervals nonMoving;
+        Intervals frozen;
+        std::vector<std::pair<OBJID, TypeDescriptor *>> unsent;
+        std::vector<OBJID> freeIds;
+        // NOTE: bounds of objects, registered since the last GC. Readers lock only buffers, which could contain address
+        std::atomic<ADDR> low;
+        std::atomic<ADDR> high;
+
+        explicit AllocationBuffer(UINT32 index)
+            : index(index)
+            , objectsPool(sizeof(Object))
+        {
+            resetBounds();
+        }
+
+        void resetBounds() {
+            low.store((ADDR) -1, std::memory_order_relaxed);
+            high.store(0, std::memory_order_relaxed);
+        }
+
+        void extendBounds(const Interval &obj) {
+            if (obj.left < low.load(std::memory_order_relaxed))
+                low.store(obj.left, std::memory_order_release);
+            if (obj.right > high.load(std::memory_order_relaxed))
+                high.store(obj.right, std::memory_order_release);
+        }
+
+        bool mayContain(ADDR address) const {
+            return low.load(std::memory_order_acquire) <= address && address <= high.load(std::memory_order_acquire);
+        }
+    };
+
+    static std::atomic<unsigned> heapsCount(0);
+
+    // NOTE: exiting threads return their buffers to heaps, which are still alive
+    static std::mutex heapsLock;
+    static std::unordered_map<unsigned, Heap *> &liveHeaps() {
+        static auto *heaps = new std::unordered_map<unsigned, Heap *>();
+        return *heaps;
+    }
+
+    struct LocalBuffer {
+        unsigned heap;
+        Heap::AllocationBuffer *buffer;
+
+        ~LocalBuffer() {
+            if (heap)
+                Heap::releaseBuffer(heap, buffer);
+        }
+    };
+
+    static thread_local LocalBuffer localBufferCache{};
+
 // --------------------------- Heap ---------------------------
 
-    Heap::Heap() = default;
+    Heap::Heap()
+        : lastId(0)
+        , buffersCount(0)
+        , sharedBuffer(0)
+        , instance(++heapsCount)
+        , typesCount(0)
+        , typesBytes(0)
+        , regionsPool(sizeof(Object))
+        , objectsCount(0)
+        , regionsCount(0)
+        , untrackedWritten(false)
+        , epoch(0)
+    {
+        for (auto &buffer : buffers)
+            buffer.store(nullptr, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(heapsLock);
+            liveHeaps()[instance] = this;
+        }
+        for (bool &c : collected) c = false;
+        nonMovingCollected = false;
+        for (int i = 0; i < generationsCount; ++i) {
+            gcCount[i] = 0;
+            gcMicroseconds[i] = 0;
+        }
+    }
+
+    Heap::~Heap() {
+        {
+            std::lock_guard<std::mutex> lock(heapsLock);
+            liveHeaps().erase(instance);
+        }
+        UINT32 count = buffersCount.load(std::memory_order_acquire);
+        for (UINT32 i = 0; i < count; ++i)
+            delete buffers[i].load(std::memory_order_relaxed);
+    }
 
-    OBJID Heap::allocateObject(ADDR address, SIZE size, char *type, unsigned long typeLength) {
-        auto *obj = new Object(address, size);
-        tree.add(*obj);
-        auto id = (OBJID) obj;
-        newAddresses[id] = std::make_pair(type, typeLength);
+    Heap::AllocationBuffer &Heap::localBuffer() {
+        if (localBufferCache.heap != instance) {
+            if (localBufferCache.heap)
+                releaseBuffer(localBufferCache.heap, localBufferCache.buffer);
+            AllocationBuffer *buffer;
+            {
+                std::lock_guard<std::mutex> lock(buffersLock);
+                UINT32 count = buffersCount.load(std::memory_order_relaxed);
+                if (!freeBuffers.empty()) {
+                    buffer = freeBuffers.back();
+                    freeBuffers.pop_back();
+                } else if (count < maxBuffers) {
+                    buffer = new AllocationBuffer(count);
+                    buffers[count].store(buffer, std::memory_order_release);
+                    buffersCount.store(count + 1, std::memory_order_release);
+                } else {
+                    buffer = buffers[sharedBuffer++ % maxBuffers].load(std::memory_order_relaxed);
+                }
+            }
+            localBufferCache.heap = instance;
+            localBufferCache.buffer = buffer;
+        }
+        return *localBufferCache.buffer;
+    }
+
+    void Heap::releaseBuffer(unsigned instance, AllocationBuffer *buffer) {
+        std::lock_guard<std::mutex> lock(heapsLock);
+        auto it = liveHeaps().find(instance);
+        if (it == liveHeaps().end())
+            return;
+        Heap *heap = it->second;
+        std::lock_guard<std::mutex> buffersGuard(heap->buffersLock);
+        heap->freeBuffers.push_back(buffer);
+    }
+
+    Intervals &Heap::index(AllocationBuffer &buffer, int generation) {
+        if (generation == frozenGeneration)
+            return buffer.frozen;
+        if (generation >= generationsCount)
+            return buffer.nonMoving;
+        return buffer.objects[generation];
+    }
+
+    OBJID Heap::newId(std::vector<OBJID> &batch) {
+        if (batch.empty()) {
+            std::lock_guard<std::mutex> lock(freeIdsLock);
+            size_t count = min(freeIds.size(), idsBatchSize);
+            batch.assign(freeIds.end() - count, freeIds.end());
+            freeIds.resize(freeIds.size() - count);
+        }
+        if (batch.empty()) {
+            OBJID id = ++lastId;
+            assert(id != 0);
+            return id;
+        }
+        OBJID id = batch.back();
+        batch.pop_back();
+        return id;
+    }
+
+    void Heap::mergeBuffers() {
+        UINT32 count = buffersCount.load(std::memory_order_acquire);
+        for (UINT32 i = 0; i < count; ++i) {
+            AllocationBuffer *buffer = buffers[i].load(std::memory_order_acquire);
+            std::lock_guard<std::mutex> bufferLock(buffer->lock);
+            for (int j = 0; j < generationsCount; ++j)
+                generations[j].absorb(buffer->objects[j]);
+            nonMoving.absorb(buffer->nonMoving);
+            frozen.absorb(buffer->frozen);
+            buffer->resetBounds();
+        }
+    }
+
+    void Heap::deleteObject(Object *obj) {
+        deletedAddresses.push_back(obj->id);
+        --objectsCount;
+        objects.set(obj->id, nullptr);
+        {
+            std::lock_guard<std::mutex> lock(bitmapsLock);
+            obj->releaseConcreteness(bitmapsAllocator);
+        }
+        AllocationBuffer *owner = buffers[obj->owner].load(std::memory_order_acquire);
+        obj->~Object();
+        std::lock_guard<std::mutex> lock(owner->lock);
+        owner->objectsPool.release(obj);
+    }
+
+    void Heap::releaseRegion(Object *region) {
+        objects.set(region->id, nullptr);
+        freeRegionIds.push_back(region->id);
+        if (shadow.isReserved())
+            shadow.write(region->left, region->right - region->left + 1, true);
+        {
+            std::lock_guard<std::mutex> lock(bitmapsLock);
+            region->releaseConcreteness(bitmapsAllocator);
+        }
+        region->~Object();
+        regionsPool.release(region);
+        --regionsCount;
+    }
+
+    bool Heap::enableShadowMemory() {
+        assert(lastId == 0);
+        return shadow.reserve();
+    }
+
+    OBJID Heap::registerObject(ADDR address, SIZE size, TypeDescriptor *type, int generation) {
+        // NOTE: memory could be occupied by collected object, which shadow is stale
+        if (shadow.isReserved())
+            shadow.write(address, size, true);
+        else if (untrackedWritten.load(std::memory_order_relaxed))
+            dropUntracked(address, size);
+        AllocationBuffer &buffer = localBuffer();
+        std::lock_guard<std::mutex> lock(buffer.lock);
+        OBJID id = newId(buffer.freeIds);
+        auto *obj = new (buffer.objectsPool.allocate()) Object(address, size, id, buffer.index);
+        index(buffer, generation).add(*obj);
+        buffer.extendBounds(*obj);
+        buffer.unsent.emplace_back(id, type);
+        objects.set(id, obj);
+        ++objectsCount;
+        return id;
+    }
+
+    bool Heap::contains(ADDR address) const {
+        return resolve(address) != nullptr;
+    }
+
+    OBJID Heap::registerRegion(ADDR address, SIZE size, RegionKind kind, bool vConcreteness) {
+        assert(kind != HeapRegion);
+        if (size == 0)
+            return 0;
+        std::lock_guard<std::mutex> lock(regionsLock);
+        ADDR right = address + size - 1;
+        auto overlapped = regions.intersecting(address, right);
+        if (overlapped.size() == 1) {
+            auto *region = (Object *) overlapped.front();
+            if (region->kind == kind && region->left <= address && right <= region->right)
+                return 0;
+        }
+        OBJID id = newId(freeRegionIds);
+        for (Interval *stale : overlapped) {
+            regions.remove(*stale);
+            releaseRegion((Object *) stale);
+        }
+        auto *region = new (regionsPool.allocate()) Object(address, size, id, 0, kind);
+        ++regionsCount;
+        if (shadow.isReserved()) {
+            shadow.write(address, size, vConcreteness);
+        } else if (!vConcreteness) {
+            std::lock_guard<std::mutex> bitmapsGuard(bitmapsLock);
+            region->allocateConcreteness(bitmapsAllocator);
+            region->write(0, size, false);
+        }
+        regions.add(*region);
+        objects.set(id, region);
         return id;
     }
 
-    void Heap::moveAndMark(ADDR oldLeft, ADDR newLeft, SIZE length) {
-        Interval i(oldLeft, length);
-        Shift s{oldLeft, newLeft};
-        tree.moveAndMark(i, s);
+    RegionKind Heap::regionKind(ADDR address) const {
+        const Object *obj = resolve(address);
+        return obj ? obj->kind : UnmanagedRegion;
+    }
+
+    void Heap::startGC(int generationsCollected, const BOOL *generationCollected, const std::vector<COR_PRF_GC_GENERATION_RANGE> &bounds) {
+        gcStart = std::chrono::steady_clock::now();
+        // NOTE: runtime is suspended, so objects of all threads can be moved into generations
+        mergeBuffers();
+        for (int i = 0; i < generationsCount; ++i)
+            collected[i] = false;
+        nonMovingCollected = false;
+        // NOTE: large and pinned object heaps are collected only by full GCs
+        for (int i = 0; i < generationsCollected; ++i)
+            if (generationCollected[i]) {
+                if (i < generationsCount)
+                    collected[i] = true;
+                else
+                    nonMovingCollected = true;
+            }
+        // NOTE: symbolic bytes of untracked memory do not survive GC, which condemns it
+        if (!shadow.isReserved() && !untrackedWritten.load(std::memory_order_relaxed))
+            return;
+        shadowMoves.clear();
+        condemnedRanges.clear();
+        for (const auto &range : bounds) {
+            int generation = (int) range.generation;
+            bool condemned = generation < generationsCount ? collected[generation] : nonMovingCollected;
+            if (condemned && range.rangeLength > 0)
+                condemnedRanges.emplace_back(range.rangeStart, range.rangeLength);
+        }
+    }
+
+    void Heap::moveAndMark(std::vector<std::pair<Interval, Shift>> &moves) {
+        std::sort(moves.begin(), moves.end(), Intervals::lessMove);
+        if (shadow.isReserved())
+            shadowMoves.insert(shadowMoves.end(), moves.begin(), moves.end());
+        for (int i = 0; i < generationsCount; ++i)
+            if (collected[i])
+                generations[i].moveAndMark(moves);
+        // NOTE: large object heap is compacted only on demand of program, so it is relocated only by full GCs
+        if (nonMovingCollected)
+            nonMoving.moveAndMark(moves);
     }
 
     bool Heap::read(ADDR address, SIZE sizeOfPtr) const {
-        VirtualAddress vAddress{};
-        if (!resolve(address, vAddress)) {
-            return false;
+        if (shadow.isReserved())
+            return shadow.read(address, sizeOfPtr);
+        const Object *obj = resolve(address);
+        if (!obj) {
+            // NOTE: untracked memory is concrete, for example, fields of objects, not yet registered in lazy heap mode
+            return !untrackedWritten.load(std::memory_order_relaxed) || readUntracked(address, sizeOfPtr);
         }
 
-        auto *obj = (Object *) vAddress.obj;
-        return obj->read(vAddress.offset, sizeOfPtr);
+        return obj->read(address - obj->left, sizeOfPtr);
     }
 
-    void Heap::write(ADDR address, SIZE sizeOfPtr, bool vConcreteness) const {
-        VirtualAddress vAddress{};
-        if (!resolve(address, vAddress)) {
-            FAIL_LOUD("Writing to heap: unable to resolve address");
+    void Heap::write(ADDR address, SIZE sizeOfPtr, bool vConcreteness) {
+        if (shadow.isReserved()) {
+            shadow.write(address, sizeOfPtr, vConcreteness);
+            return;
         }
+        Object *obj = resolve(address);
+        if (!obj) {
+            if (!vConcreteness)
+                writeUntracked(address, sizeOfPtr);
+            return;
+        }
+        writeObject(obj, address - obj->left, sizeOfPtr, vConcreteness);
+    }
 
-        auto *obj = (Object *) vAddress.obj;
-        obj->write(vAddress.offset, sizeOfPtr, vConcreteness);
+    bool Heap::readUntracked(ADDR address, SIZE size) const {
+        std::lock_guard<std::mutex> lock(regionsLock);
+        ADDR right = address + size - 1;
+        // NOTE: read starts in untracked memory, but it may end in symbolic bytes, which follow it
+        for (Interval *interval : regions.intersecting(address, right)) {
+            auto *region = (const Object *) interval;
+            ADDR readLeft = max(address, region->left);
+            ADDR readRight = min(right, region->right);
+            if (!region->read(readLeft - region->left, readRight - readLeft + 1))
+                return false;
+        }
+        return true;
     }
 
-    bool Heap::resolve(ADDR address, VirtualAddress &vAddress) const {
-        if (const Interval *i = tree.find(address)) {
-            vAddress.offset = address - i->left;
-            vAddress.obj = (OBJID) i;
-            return true;
+    void Heap::releaseUntracked(ADDR address, SIZE size) {
+        if (shadow.isReserved())
+            shadow.write(address, size, true);
+        else if (untrackedWritten.load(std::memory_order_relaxed))
+            dropUntracked(address, size);
+    }
+
+    void Heap::writeObject(Object *obj, SIZE offset, SIZE size, bool vConcreteness) {
+        if (!obj->hasConcreteness()) {
+            if (vConcreteness)
+                return;
+            std::lock_guard<std::mutex> lock(bitmapsLock);
+            if (!obj->hasConcreteness())
+                obj->allocateConcreteness(bitmapsAllocator);
         }
-        return false;
+        obj->write(offset, size, vConcreteness);
     }
 
-    void Heap::markSurvivedObjects(ADDR start, SIZE length) {
-        Interval i(start, length);
-        tree.mark(i);
+    void Heap::addUntrackedRegion(ADDR address, SIZE size) {
+        auto *region = new (regionsPool.allocate()) Object(address, size, newId(freeRegionIds), untrackedOwner, UnmanagedRegion);
+        ++regionsCount;
+        writeObject(region, 0, size, false);
+        regions.add(*region);
+        objects.set(region->id, region);
     }
 
-    void Heap::clearAfterGC() {
-        auto deleted = tree.clearUnmarked();
-        for (Interval *address : deleted)
-            deletedAddresses.push_back((OBJID) address);
+    void Heap::writeUntracked(ADDR address, SIZE size) {
+        std::lock_guard<std::mutex> lock(regionsLock);
+        ADDR right = address + size - 1;
+        ADDR left = address;
+        // NOTE: parts of write, which fall into regions, are written into them, the rest of it gets regions of its own
+        for (Interval *interval : regions.intersecting(address, right)) {
+            auto *region = (Object *) interval;
+            if (left < region->left)
+                addUntrackedRegion(left, region->left - left);
+            ADDR writtenLeft = max(left, region->left);
+            ADDR writtenRight = min(right, region->right);
+            writeObject(region, writtenLeft - region->left, writtenRight - writtenLeft + 1, false);
+            left = region->right + 1;
+        }
+        if (left <= right)
+            addUntrackedRegion(left, right - left + 1);
+        untrackedWritten.store(true, std::memory_order_relaxed);
     }
 
-    // TODO: store new addresses or get them from tree? #do
-    std::map<OBJID, std::pair<char*, unsigned long>> Heap::flushObjects() {
-//        return tree.flush();
-        std::map<OBJID, std::pair<char*, unsigned long>> result;
-        for (const auto &address : newAddresses)
-            result[address.first] = address.second;
-        newAddresses.clear();
+    void Heap::dropUntracked(ADDR address, SIZE size) {
+        std::lock_guard<std::mutex> lock(regionsLock);
+        for (Interval *interval : regions.intersecting(address, address + size - 1)) {
+            auto *region = (Object *) interval;
+            if (region->owner != untrackedOwner)
+                continue;
+            regions.remove(*region);
+            releaseRegion(region);
+        }
+    }
+
+    Object *Heap::resolveUncached(ADDR address) const {
+        // NOTE: young objects are probed first, they are accessed most often
+        for (const Intervals &generation : generations) {
+            if (const Interval *i = generation.find(address))
+                return (Object *) i;
+        }
+        if (const Interval *i = nonMoving.find(address))
+            return (Object *) i;
+        if (const Interval *i = frozen.find(address))
+            return (Object *) i;
+        {
+            // NOTE: objects, registered since the last GC, are still in allocation buffers
+            UINT32 count = buffersCount.load(std::memory_order_acquire);
+            for (UINT32 i = 0; i < count; ++i) {
+                AllocationBuffer *buffer = buffers[i].load(std::memory_order_acquire);
+                if (!buffer->mayContain(address))
+                    continue;
+                std::lock_guard<std::mutex> bufferLock(buffer->lock);
+                for (const Intervals &generation : buffer->objects) {
+                    if (const Interval *i = generation.find(address))
+                        return (Object *) i;
+                }
+                if (const Interval *i = buffer->nonMoving.find(address))
+                    return (Object *) i;
+                if (const Interval *i = buffer->frozen.find(address))
+                    return (Object *) i;
+            }
+        }
+        std::lock_guard<std::mutex> lock(regionsLock);
+        return (Object *) regions.find(address);
+    }
+
+    Object *Heap::resolve(ADDR address) const {
+        unsigned currentEpoch = epoch.load(std::memory_order_acquire);
+        ResolveCacheEntry &last = resolveCache.lastHit;
+        ResolveCacheEntry &entry = resolveCache.entries[(address >> resolveCacheGranularity) & (resolveCacheSize - 1)];
+        if (hits(last, instance, currentEpoch, address) && isLive(last, objects))
+            return last.obj;
+        if (hits(entry, instance, currentEpoch, address) && isLive(entry, objects)) {
+            last = entry;
+            return entry.obj;
+        }
+        Object *obj = resolveUncached(address);
+        if (obj) {
+            entry = {obj->left, obj->right, instance, obj, currentEpoch, obj->id, obj->kind != HeapRegion};
+            last = entry;
+        }
+        return obj;
+    }
+
+    void Heap::markSurvivedObjects(std::vector<Interval> &survived) {
+        std::sort(survived.begin(), survived.end(), Intervals::lessInterval);
+        if (shadow.isReserved()) {
+            for (const Interval &range : survived)
+                shadowMoves.emplace_back(range, Shift{range.left, range.left});
+        }
+        for (int i = 0; i < generationsCount; ++i)
+            if (collected[i])
+                generations[i].mark(survived);
+        if (nonMovingCollected)
+            nonMoving.mark(survived);
+    }
+
+    static bool rangeStartsBefore(const COR_PRF_GC_GENERATION_RANGE &range, ADDR address) {
+        return range.rangeStart + range.rangeLength <= address;
+    }
+
+    void Heap::reindexSurvivors(std::vector<COR_PRF_GC_GENERATION_RANGE> &bounds) {
+        // NOTE: runtime may promote survivors, keep them in place or demote them, so each of them is indexed by range
+        //       of generation, which it is in now. Without bounds, survivors are assumed to be promoted
+        std::sort(bounds.begin(), bounds.end(), [](const COR_PRF_GC_GENERATION_RANGE &x, const COR_PRF_GC_GENERATION_RANGE &y) {
+            return x.rangeStart < y.rangeStart;
+        });
+        std::vector<Interval *> survivors[generationsCount];
+        for (int i = 0; i < generationsCount; ++i) {
+            if (!collected[i])
+                continue;
+            int promoted = min(i + 1, generationsCount - 1);
+            generations[i].extract([&](Interval *obj) {
+                int generation = promoted;
+                auto range = std::lower_bound(bounds.begin(), bounds.end(), obj->left, rangeStartsBefore);
+                if (range != bounds.end() && range->rangeStart <= obj->left && range->generation < generationsCount)
+                    generation = (int) range->generation;
+                if (generation == i)
+                    return false;
+                survivors[generation].push_back(obj);
+                return true;
+            });
+        }
+        for (int i = 0; i < generationsCount; ++i) {
+            std::sort(survivors[i].begin(), survivors[i].end(), [](const Interval *x, const Interval *y) {
+                return x->left < y->left;
+            });
+            generations[i].merge(survivors[i]);
+        }
+    }
+
+    void Heap::clearAfterGC(std::vector<COR_PRF_GC_GENERATION_RANGE> &bounds) {
+        std::lock_guard<std::mutex> lock(flushLock);
+        int oldest = nonMovingCollected ? generationsCount - 1 : 0;
+        for (int i = 0; i < generationsCount; ++i)
+            if (collected[i])
+                oldest = max(oldest, i);
+        if (nonMovingCollected) {
+            for (Interval *address : nonMoving.clearUnmarked())
+                deleteObject((Object *) address);
+            nonMovingCollected = false;
+        }
+        for (int i = 0; i < generationsCount; ++i) {
+            if (!collected[i])
+                continue;
+            for (Interval *address : generations[i].clearUnmarked())
+                deleteObject((Object *) address);
+        }
+        reindexSurvivors(bounds);
+        if (shadow.isReserved()) {
+            shadow.move(shadowMoves, condemnedRanges);
+            shadowMoves.clear();
+            condemnedRanges.clear();
+        } else if (!condemnedRanges.empty()) {
+            for (const Interval &range : condemnedRanges)
+                dropUntracked(range.left, range.right - range.left + 1);
+            condemnedRanges.clear();
+        }
+        for (bool &c : collected)
+            c = false;
+        epoch.fetch_add(1, std::memory_order_release);
+        auto elapsed = std::chrono::steady_clock::now() - gcStart;
+        ++gcCount[oldest];
+        gcMicroseconds[oldest] += std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    }
+
+    void Heap::newObjects(AllocationLog &log) {
+        std::lock_guard<std::mutex> lock(flushLock);
+        UINT32 count = buffersCount.load(std::memory_order_acquire);
+        for (UINT32 i = 0; i < count; ++i) {
+            AllocationBuffer *buffer = buffers[i].load(std::memory_order_acquire);
+            std::lock_guard<std::mutex> bufferLock(buffer->lock);
+            for (const auto &entry : buffer->unsent) {
+                TypeDescriptor *type = entry.second;
+                if (!type->registered) {
+                    type->registered = true;
+                    type->id = typesCount++;
+                    typesBytes += type->bytes.size();
+                    log.appendType(type);
+                }
+                log.append(entry.first, type->id);
+            }
+            buffer->unsent.clear();
+        }
+    }
+
+    void Heap::flushDeletedObjects(std::vector<OBJID> &deleted) {
+        std::lock_guard<std::mutex> lock(flushLock);
+        deleted.clear();
+        deleted.swap(deletedAddresses);
+    }
+
+    void Heap::forgetTypes(std::vector<const TypeDescriptor *> &types) {
+        std::sort(types.begin(), types.end());
+        auto isForgotten = [&types](const std::pair<OBJID, TypeDescriptor *> &entry) {
+            return std::binary_search(types.begin(), types.end(), (const TypeDescriptor *) entry.second);
+        };
+        std::lock_guard<std::mutex> lock(flushLock);
+        UINT32 count = buffersCount.load(std::memory_order_acquire);
+        for (UINT32 i = 0; i < count; ++i) {
+            AllocationBuffer *buffer = buffers[i].load(std::memory_order_acquire);
+            std::lock_guard<std::mutex> bufferLock(buffer->lock);
+            auto &unsent = buffer->unsent;
+            unsent.erase(std::remove_if(unsent.begin(), unsent.end(), isForgotten), unsent.end());
+        }
+    }
+
+    void Heap::recycleIds(const std::vector<OBJID> &ids) {
+        if (ids.empty())
+            return;
+        std::lock_guard<std::mutex> lock(freeIdsLock);
+        freeIds.insert(freeIds.end(), ids.begin(), ids.end());
+    }
+
+    HeapStats Heap::stats() {
+        static_assert(HeapStats::generationsCount == generationsCount, "heap stats must cover all generations");
+        HeapStats result;
+        result.objectsCount = objectsCount.load(std::memory_order_relaxed);
+        result.regionsCount = regionsCount.load(std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(bitmapsLock);
+            result.bitmapBytes = bitmapsAllocator.allocatedBytes();
+        }
+        std::lock_guard<std::mutex> lock(flushLock);
+        result.typeBytes = typesBytes;
+        result.pendingNewObjects = 0;
+        result.pendingDeletedObjects = deletedAddresses.size();
+        UINT32 count = buffersCount.load(std::memory_order_acquire);
+        for (UINT32 i = 0; i < count; ++i) {
+            AllocationBuffer *buffer = buffers[i].load(std::memory_order_acquire);
+            std::lock_guard<std::mutex> bufferLock(buffer->lock);
+            result.pendingNewObjects += buffer->unsent.size();
+        }
+        for (int i = 0; i < generationsCount; ++i) {
+            result.gcCount[i] = gcCount[i];
+            result.gcMicroseconds[i] = gcMicroseconds[i];
+        }
         return result;
     }
 
     void Heap::dump() const {
         LOG(tout << "-------------- HEAP DUMP --------------" << std::endl);
-        std::string dump = tree.dumpObjects();
+        std::string dump;
+        for (int i = 0; i < generationsCount; ++i)
+            dump += "Generation " + std::to_string(i) + ":\n" + generations[i].dumpObjects();
+        dump += "Non-moving:\n" + nonMoving.dumpObjects();
+        dump += "Frozen:\n" + frozen.dumpObjects();
+        {
+            std::lock_guard<std::mutex> lock(regionsLock);
+            dump += "Regions:\n" + regions.dumpObjects();
+        }
         LOG(tout << dump.c_str() << std::endl);
         LOG(tout << "-------------- DUMP END ---------------" << std::endl);
     }
 
     VirtualAddress Heap::physToVirtAddress(ADDR physAddress) const {
-        VirtualAddress vAddress{};
-        if (!resolve(physAddress, vAddress)) {
+        if (physAddress == 0)
+            return VirtualAddress{0, 0};
+        const Object *obj = resolve(physAddress);
+        if (!obj) {
             FAIL_LOUD("unable to resolve physical address!");
         }
-        return vAddress;
+        return VirtualAddress{obj->id, physAddress - obj->left};
     }
 
-    ADDR Heap::virtToPhysAddress(const VirtualAddress &virtAddress) {
-        auto object = (Object *)virtAddress.obj;
+    ADDR Heap::virtToPhysAddress(const VirtualAddress &virtAddress) const {
+        if (virtAddress.obj == 0)
+            return virtAddress.offset;
+        const Object *object = objects.get(virtAddress.obj);
+        if (!object) {
+            FAIL_LOUD("virtual address refers to collected object!");
+        }
         return object->left + virtAddress.offset;
     }
 }
@@ -3,7 +3,12 @@
 
 #include <map>
 #include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
 #include "intervalTree.h"
+#include "allocator.h"
+#include "bitmap.h"
 #include "cor.h"
 #include "corprof.h"
 #include "corhdr.h"
@@ -12,7 +17,7 @@ namespace vsharp {
 
 #define ADDR UINT_PTR
 #define SIZE UINT_PTR
-#define OBJID UINT_PTR
+#define OBJID UINT32
 
 class Shift {
 public:
@@ -54,57 +59,285 @@ public:
 
 };
 
-typedef char cell;
+// NOTE: kinds of tracked memory. Only heap objects are allocated and moved by GC, other regions are registered by
+//       probes, when program takes their address, or keep symbolic bytes of untracked memory
+enum RegionKind {
+    HeapRegion,
+    StackRegion,
+    StaticRegion,
+    UnmanagedRegion
+};
 
 class Object : public Interval {
 private:
-    // NOTE: each bit corresponds of concreteness of memory byte
-    cell *concreteness = nullptr;
-    const cell max = 0xFF;
-    const cell min = 0x00;
-    const size_t sizeofCell = sizeof(cell) * 8;
+    // NOTE: each bit corresponds of concreteness of memory byte; no bitmap means that object is fully concrete.
+    //       Bitmaps are published atomically, because probes of other threads may read them concurrently
+    std::atomic<cell *> concreteness{nullptr};
+    // NOTE: for large objects, each bit corresponds to concreteness of block of 'blockCells' bitmap cells
+    std::atomic<cell *> summary{nullptr};
+    static const SIZE blockCells = 8;
+    static const SIZE blockSize = blockCells * cellBits;
+    static const SIZE summaryThreshold = 4 * blockCells;
+
+    SIZE cellsCount() const;
+    SIZE blocksCount() const;
+    SIZE summaryCellsCount() const;
+    bool blockIsConcrete(const cell *bits, SIZE block) const;
+
 public:
-    Object(ADDR address, SIZE size);
+    const OBJID id;
+    // NOTE: index of allocation buffer, from which object was allocated
+    const UINT32 owner;
+    const RegionKind kind;
+
+    Object(ADDR address, SIZE size, OBJID id, UINT32 owner, RegionKind kind = HeapRegion);
     ~Object() override;
+    bool hasConcreteness() const;
+    void allocateConcreteness(SlabAllocator &allocator);
+    void releaseConcreteness(SlabAllocator &allocator);
     std::string toString() const override;
     bool read(SIZE offset, SIZE size) const;
+    // NOTE: symbolic writes require concreteness bitmap to be allocated
     void write(SIZE offset, SIZE size, bool vConcreteness);
 };
 
 typedef IntervalTree<Interval, Shift, ADDR> Intervals;
 
+// NOTE: serialized type of heap object, shared by all objects of one class
+struct TypeDescriptor {
+    std::vector<char> bytes;
+    // NOTE: index in the session type table of server; assigned, when type is sent for the first time
+    bool registered = false;
+    UINT32 id = 0;
+};
+
+// NOTE: append-only log of objects, allocated since the last command. Each type descriptor is sent only once per
+//       session, later objects of that type refer to it by varint-encoded id, which is assigned by heap. Bytes of
+//       new types are copied, so that log stays valid, if descriptor is released by unloading of its module
+class AllocationLog {
+private:
+    std::vector<OBJID> ids;
+    std::vector<UINT32> typeIds;
+    std::vector<char> newTypes;
+    unsigned newTypesCount_ = 0;
+    size_t typeIdsSize = 0;
+
+public:
+    void appendType(const TypeDescriptor *type);
+    void append(OBJID id, UINT32 typeId);
+    unsigned count() const;
+    unsigned newTypesCount() const;
+    size_t serializedSize() const;
+    void serialize(char *&buffer) const;
+    // NOTE: drops sent entries; buffers keep their capacity, so steady state logging does not allocate
+    void clear();
+};
+
+// NOTE: occupancy of heap metadata and time, spent in GC callbacks. Collections of large and pinned object heaps
+//       are accounted in gen2
+struct HeapStats {
+    static const int generationsCount = 3;
+    UINT64 objectsCount;
+    UINT64 regionsCount;
+    UINT64 bitmapBytes;
+    UINT64 typeBytes;
+    UINT64 pendingNewObjects;
+    UINT64 pendingDeletedObjects;
+    UINT64 gcCount[generationsCount];
+    UINT64 gcMicroseconds[generationsCount];
+
+    size_t serializedSize() const;
+    void serialize(char *&buffer) const;
+    std::string toString() const;
+};
+
+// NOTE: 'obj' is dense id of object, 0 stands for null reference
 struct VirtualAddress
 {
     OBJID obj;
     SIZE offset;
 };
 
+// NOTE: id -> object table. It is split into chunks, which are allocated on demand and never moved,
+//       so lookups need no synchronization
+class ObjectsTable {
+private:
+    static const UINT32 chunkBits = 16;
+    static const UINT32 chunkSize = 1u << chunkBits;
+    static const UINT32 chunksCount = 1u << (32 - chunkBits);
+    std::atomic<Object **> chunks[chunksCount];
+    std::mutex chunksLock;
+
+public:
+    ObjectsTable();
+    ~ObjectsTable();
+    void set(OBJID id, Object *obj);
+    Object *get(OBJID id) const;
+};
+
+// NOTE: direct-mapped shadow of address space: concreteness of byte 'a' is bit 'a % 8' of shadow byte 'a / 8'.
+//       Set bits mark symbolic bytes, so untouched zero pages stand for concrete memory, and reserved space is backed
+//       by physical memory only where something has been written symbolically
+class ShadowMemory {
+private:
+    UINT8 *m_base;
+    SIZE m_size;
+
+    void load(ADDR address, SIZE size, std::vector<UINT8> &bits) const;
+    void store(ADDR address, SIZE size, const UINT8 *bits);
+
+public:
+    static const SIZE pageSize = 4096;
+
+    ShadowMemory();
+    ShadowMemory(const ShadowMemory &other) = delete;
+    ShadowMemory &operator=(const ShadowMemory &other) = delete;
+    ~ShadowMemory();
+
+    bool reserve();
+    bool isReserved() const;
+
+    bool read(ADDR address, SIZE size) const;
+    void write(ADDR address, SIZE size, bool vConcreteness);
+    // NOTE: makes memory concrete, whole shadow pages are returned to system
+    void clear(ADDR address, SIZE size);
+    // NOTE: ranges are moved simultaneously, so destination of one range may overlap source of another.
+    //       'freed' ranges are cleared after sources are saved, so that dead objects leave no stale shadow
+    void move(const std::vector<std::pair<Interval, Shift>> &moves, const std::vector<Interval> &freed);
+};
+
 class Heap {
 private:
-    Intervals tree;
-    // TODO: store new addresses or get them from tree? #do
-    std::map<OBJID, std::pair<char*, unsigned long>> newAddresses;
+    struct AllocationBuffer;
+
+    static const int generationsCount = 3;
+    Intervals generations[generationsCount];
+    bool collected[generationsCount];
+    // NOTE: objects of large and pinned object heaps are not compacted with generations, and frozen objects are never
+    //       collected at all. They are indexed apart, so that ephemeral GCs do not scan them
+    Intervals nonMoving;
+    bool nonMovingCollected;
+    Intervals frozen;
+    // NOTE: ids of deleted objects are reused only after server has acknowledged their deletion, so that it never
+    //       confuses new object with the old one. Buffers take recycled ids in batches, so that allocating threads
+    //       rarely contend for them. Ids of regions are never sent to server, so they are reused at once
+    ObjectsTable objects;
+    std::atomic<OBJID> lastId;
+    static const size_t idsBatchSize = 1024;
+    std::mutex freeIdsLock;
+    std::vector<OBJID> freeIds;
+    // NOTE: each thread registers objects in its own buffer, so allocating threads do not contend with each other.
+    //       Buffers are merged into generations at GC, when runtime is suspended, so that generations never change
+    //       while probes read them. Slots of buffers are published once and never cleared, so readers scan them
+    //       without global lock. Buffers of exited threads keep their objects, so they are reused by new threads;
+    //       if there are more threads than slots, threads share buffers
+    static const UINT32 maxBuffers = 256;
+    std::atomic<AllocationBuffer *> buffers[maxBuffers];
+    std::atomic<UINT32> buffersCount;
+    std::mutex buffersLock;
+    std::vector<AllocationBuffer *> freeBuffers;
+    UINT32 sharedBuffer;
+    // NOTE: distinguishes heaps in thread-local caches
+    const unsigned instance;
+    // NOTE: guards collection of unsent objects, ids of session types and deleted objects
+    std::mutex flushLock;
+    UINT32 typesCount;
+    size_t typesBytes;
     std::vector<OBJID> deletedAddresses;
+    // NOTE: concreteness bitmaps are allocated from slabs and reclaimed after GC
+    std::mutex bitmapsLock;
+    SlabAllocator bitmapsAllocator;
+
+    // NOTE: static fields, which addresses were taken by program, and symbolic bytes of untracked memory. They are
+    //       registered and dropped by probes, not by GC, so they are kept apart from generations under own lock
+    Intervals regions;
+    mutable std::mutex regionsLock;
+    FixedSizePool regionsPool;
+    std::vector<OBJID> freeRegionIds;
+    // NOTE: untracked memory is concrete. Shadow keeps symbolic bytes of it as of any other memory, and without shadow
+    //       they are kept in unmanaged regions of this owner. In both cases they are reset, when object is registered
+    static const UINT32 untrackedOwner = ~(UINT32) 0;
+    std::atomic<bool> untrackedWritten;
+
+    // NOTE: if reserved, concreteness of all memory is kept in shadow, and per-object bitmaps are not used
+    ShadowMemory shadow;
+    // NOTE: runtime reports moves of one GC in several batches, so shadow is moved at once, when GC is finished.
+    //       Survivors are kept as moves to the same address, and condemned ranges of generations are freed
+    std::vector<std::pair<Interval, Shift>> shadowMoves;
+    std::vector<Interval> condemnedRanges;
+
+    std::atomic<UINT64> objectsCount;
+    std::atomic<UINT64> regionsCount;
+    // NOTE: GC statistics are updated only while runtime is suspended, and read under 'flushLock'
+    std::chrono::steady_clock::time_point gcStart;
+    UINT64 gcCount[generationsCount];
+    UINT64 gcMicroseconds[generationsCount];
 
-    bool resolve(ADDR address, VirtualAddress &vAddress) const;
+    // NOTE: incremented after each GC; resolve caches, filled in previous epochs, are stale
+    std::atomic<unsigned> epoch;
+
+    friend struct LocalBuffer;
+    AllocationBuffer &localBuffer();
+    static void releaseBuffer(unsigned instance, AllocationBuffer *buffer);
+    static Intervals &index(AllocationBuffer &buffer, int generation);
+    OBJID newId(std::vector<OBJID> &batch);
+    void mergeBuffers();
+    void deleteObject(Object *obj);
+    void reindexSurvivors(std::vector<COR_PRF_GC_GENERATION_RANGE> &bounds);
+    void releaseRegion(Object *region);
+    void writeObject(Object *obj, SIZE offset, SIZE size, bool vConcreteness);
+    void addUntrackedRegion(ADDR address, SIZE size);
+    bool readUntracked(ADDR address, SIZE size) const;
+    void writeUntracked(ADDR address, SIZE size);
+    void dropUntracked(ADDR address, SIZE size);
+    Object *resolveUncached(ADDR address) const;
+    Object *resolve(ADDR address) const;
 
 public:
     Heap();
+    ~Heap();
+
+    // NOTE: switches concreteness tracking to shadow memory; must be called before any object is registered
+    bool enableShadowMemory();
+
+    // NOTE: generations above gen2 are large and pinned object heaps, as reported by runtime
+    static const int frozenGeneration = -1;
+
+    OBJID registerObject(ADDR address, SIZE size, TypeDescriptor *type, int generation);
+    bool contains(ADDR address) const;
 
-    OBJID allocateObject(ADDR address, SIZE size, char *type, unsigned long typeLength);
+    // NOTE: returns id of new region or 0, if memory is already covered by region of the same kind.
+    //       Regions, overlapped by the new one, are stale: their memory has been reused, so they are dropped
+    OBJID registerRegion(ADDR address, SIZE size, RegionKind kind, bool vConcreteness);
+    // NOTE: memory, which is not tracked at all, is considered unmanaged
+    RegionKind regionKind(ADDR address) const;
 
-    void moveAndMark(ADDR oldLeft, ADDR newLeft, SIZE length);
-    void markSurvivedObjects(ADDR start, SIZE length);
-    void clearAfterGC();
+    // NOTE: 'bounds' are generation ranges of runtime before GC, symbolic bytes of condemned ones are cleared after GC
+    void startGC(int generationsCollected, const BOOL *generationCollected, const std::vector<COR_PRF_GC_GENERATION_RANGE> &bounds);
+    void moveAndMark(std::vector<std::pair<Interval, Shift>> &moves);
+    void markSurvivedObjects(std::vector<Interval> &survived);
+    // NOTE: 'bounds' are generation ranges of runtime after GC, survivors of collected generations are indexed by them
+    void clearAfterGC(std::vector<COR_PRF_GC_GENERATION_RANGE> &bounds);
 
-    std::map<OBJID, std::pair<char*, unsigned long>> flushObjects();
+    // NOTE: moves objects, registered since the last call, into 'log' of caller, who clears it after it is sent
+    void newObjects(AllocationLog &log);
+    // NOTE: 'deleted' is swapped with the internal log, so capacity of both vectors is reused
+    void flushDeletedObjects(std::vector<OBJID> &deleted);
+    // NOTE: must be called only after server has applied deletions of 'ids'
+    void recycleIds(const std::vector<OBJID> &ids);
+    // NOTE: drops unsent entries of objects of 'types', so that their descriptors can be released. Types are released
+    //       only when their classes are unloaded, so objects of them are already dead
+    void forgetTypes(std::vector<const TypeDescriptor *> &types);
 
     VirtualAddress physToVirtAddress(ADDR physAddress) const;
-    static ADDR virtToPhysAddress(const VirtualAddress &virtAddress);
+    ADDR virtToPhysAddress(const VirtualAddress &virtAddress) const;
 
     bool read(ADDR address, SIZE sizeOfPtr) const;
-    void write(ADDR address, SIZE sizeOfPtr, bool vConcreteness) const;
+    void write(ADDR address, SIZE sizeOfPtr, bool vConcreteness);
+    // NOTE: untracked memory is freed by its owner, for example, by frame, so its symbolic bytes are dropped
+    void releaseUntracked(ADDR address, SIZE size);
 
+    HeapStats stats();
     void dump() const;
 };
 
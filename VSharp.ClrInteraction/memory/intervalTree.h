@@ -3,60 +3,174 @@
 
 #include "../logging.h"
 #include <cassert>
+#include <vector>
+#include <algorithm>
 
+// NOTE: ordered index of non-overlapping intervals. Objects are kept sorted by their left bound, so point lookup
+//       is a binary search. During GC objects are moved in place, but 'lefts' keeps the pre-GC bounds until
+//       'clearUnmarked' rebuilds the index: all ranges, reported by the runtime during one GC, refer to old addresses.
 template<typename Interval, typename Shift, typename Point>
 class IntervalTree {
 private:
     std::vector<Interval *> objects;
+    std::vector<Point> lefts;
+    bool moved = false;
+
+    // Returns index of the first interval, which left bound is not less than p
+    size_t lowerBound(const Point &p) const {
+        return std::lower_bound(lefts.begin(), lefts.end(), p) - lefts.begin();
+    }
+
+    static bool less(const Interval *x, const Interval *y) {
+        return x->left < y->left;
+    }
+
+    void rebuildLefts() {
+        lefts.resize(objects.size());
+        for (size_t i = 0; i < objects.size(); ++i)
+            lefts[i] = objects[i]->left;
+    }
+
 public:
+    static bool lessInterval(const Interval &x, const Interval &y) {
+        return x.left < y.left;
+    }
+
+    static bool lessMove(const std::pair<Interval, Shift> &x, const std::pair<Interval, Shift> &y) {
+        return x.first.left < y.first.left;
+    }
+
+    bool isEmpty() const {
+        return objects.empty();
+    }
+
     void add(Interval &node) {
-        objects.push_back(&node);
+        assert(!moved);
+        if (objects.empty() || lefts.back() < node.left) {
+            // NOTE: fast path, allocation context grows towards higher addresses
+            objects.push_back(&node);
+            lefts.push_back(node.left);
+            return;
+        }
+        size_t i = lowerBound(node.left);
+        assert(i == objects.size() || node.right < lefts[i]);
+        objects.insert(objects.begin() + i, &node);
+        lefts.insert(lefts.begin() + i, node.left);
+    }
+
+    void remove(Interval &node) {
+        assert(!moved);
+        size_t i = lowerBound(node.left);
+        assert(i < objects.size() && objects[i] == &node);
+        objects.erase(objects.begin() + i);
+        lefts.erase(lefts.begin() + i);
+    }
+
+    // Returns intervals, which intersect [left, right]
+    std::vector<Interval *> intersecting(const Point &left, const Point &right) const {
+        std::vector<Interval *> result;
+        size_t i = std::upper_bound(lefts.begin(), lefts.end(), left) - lefts.begin();
+        if (i > 0 && objects[i - 1]->contains(left))
+            --i;
+        for (; i < objects.size() && lefts[i] <= right; ++i)
+            result.push_back(objects[i]);
+        return result;
     }
 
     const Interval *find(const Point &p) const {
-        for (const Interval *obj : objects) {
+        auto it = std::upper_bound(lefts.begin(), lefts.end(), p);
+        if (it != lefts.begin()) {
+            const Interval *obj = objects[it - lefts.begin() - 1];
             if (obj->contains(p))
                 return obj;
         }
-        FAIL_LOUD("Unbound pointer!");
+        return nullptr;
     }
 
-    void moveAndMark(const Interval &interval, const Shift &shift) {
-        for (Interval *obj : objects) {
-            if (interval.includes(*obj)) {
-                obj->move(shift);
+    // NOTE: moves are applied in one merge pass over the sorted index, so 'moves' must be sorted by old left bound
+    void moveAndMark(const std::vector<std::pair<Interval, Shift>> &moves) {
+        assert(std::is_sorted(moves.begin(), moves.end(), lessMove));
+        size_t i = 0;
+        for (const auto &move : moves) {
+            const Interval &interval = move.first;
+            i = std::lower_bound(lefts.begin() + i, lefts.end(), interval.left) - lefts.begin();
+            for (; i < objects.size() && lefts[i] <= interval.right; ++i) {
+                Interval *obj = objects[i];
+                assert(interval.includes(*obj));
+                obj->move(move.second);
                 obj->mark();
-            } else {
-                assert(!interval.intersects(*obj));
+                moved = true;
             }
         }
     }
 
-    void mark(const Interval &interval) {
-        for (Interval *obj : objects) {
-            if (interval.includes(*obj))
+    void mark(const std::vector<Interval> &intervals) {
+        assert(std::is_sorted(intervals.begin(), intervals.end(), lessInterval));
+        size_t i = 0;
+        for (const Interval &interval : intervals) {
+            i = std::lower_bound(lefts.begin() + i, lefts.end(), interval.left) - lefts.begin();
+            for (; i < objects.size() && lefts[i] <= interval.right; ++i) {
+                Interval *obj = objects[i];
+                assert(interval.includes(*obj));
                 obj->mark();
-            else
-                assert(!interval.intersects(*obj));
+            }
         }
     }
 
-    // TODO: copy all marked and clear or remove unmarked one by one?
+    // NOTE: unmarked intervals are removed from the tree, their owner is responsible for releasing them
     std::vector<Interval *> clearUnmarked() {
-        std::vector<Interval *> marked;
         std::vector<Interval *> unmarked;
+        size_t count = 0;
         for (Interval *obj : objects)
             if (obj->isMarked()) {
                 obj->unmark();
-                marked.push_back(obj);
+                objects[count++] = obj;
             } else {
                 unmarked.push_back(obj);
-                delete obj;
             }
-        objects = marked;
+        objects.resize(count);
+        if (moved) {
+            // NOTE: compaction preserves order inside each moved range, so objects are mostly sorted here
+            std::sort(objects.begin(), objects.end(), less);
+            moved = false;
+        }
+        rebuildLefts();
         return unmarked;
     }
 
+    // Removes intervals, for which 'moveOut' holds, from the tree; 'moveOut' takes care of them
+    template<typename Predicate>
+    void extract(Predicate moveOut) {
+        assert(!moved);
+        size_t count = 0;
+        for (Interval *obj : objects)
+            if (!moveOut(obj))
+                objects[count++] = obj;
+        if (count == objects.size())
+            return;
+        objects.resize(count);
+        rebuildLefts();
+    }
+
+    // Merges 'intervals', sorted by left bound, into this tree
+    void merge(const std::vector<Interval *> &intervals) {
+        assert(!moved);
+        if (intervals.empty())
+            return;
+        size_t middle = objects.size();
+        objects.insert(objects.end(), intervals.begin(), intervals.end());
+        std::inplace_merge(objects.begin(), objects.begin() + middle, objects.end(), less);
+        rebuildLefts();
+    }
+
+    // Moves all intervals of 'other' into this tree
+    void absorb(IntervalTree &other) {
+        assert(!other.moved);
+        merge(other.objects);
+        other.objects.clear();
+        other.lefts.clear();
+    }
+
     std::vector<Interval*> flush() {
         std::vector<Interval*> newAddresses;
         for (Interval *obj : objects)
@@ -1,6 +1,8 @@
 #include "memory.h"
 #include "stack.h"
+#include <atomic>
 #include <mutex>
+#include <unordered_map>
 
 using namespace vsharp;
 
@@ -10,38 +12,82 @@ ThreadID currentThreadNotConfigured() {
 
 std::function<ThreadID()> vsharp::currentThread(&currentThreadNotConfigured);
 
-Heap vsharp::heap = Heap();
+bool vsharp::lazyHeap = false;
+
+void (*vsharp::lazyObjectRegistrar)(INT_PTR ref) = nullptr;
+
+bool (*vsharp::lazyHeapContains)(INT_PTR address) = nullptr;
+
+Heap vsharp::heap;
+
+unsigned vsharp::heapStatsPeriod = 0;
 
 #ifdef _DEBUG
 std::map<unsigned, const char*> vsharp::stringsPool;
 int topStringIndex = 0;
 #endif
 
-ThreadID lastThreadID = 0;
-Stack *currentStack = nullptr;
+static std::unordered_map<ThreadID, Stack *> stacks;
+static std::mutex stacksLock;
+// NOTE: incremented, when stack is destroyed; thread-local binding, made in earlier epoch, is checked against registry
+static std::atomic<unsigned> stacksEpoch(0);
+static thread_local Stack *currentStack = nullptr;
+static thread_local unsigned currentStackEpoch = 0;
 
-inline void switchContext() {
-    ThreadID tid = currentThread();
-    if (tid != lastThreadID) {
-        lastThreadID = tid;
-        Stack *&s = stacks[tid];
-        if (!s) s = new Stack();
-        currentStack = s;
-    }
+static Stack *registerStack(ThreadID tid) {
+    std::lock_guard<std::mutex> lock(stacksLock);
+    Stack *&s = stacks[tid];
+    if (!s) s = new Stack();
+    return s;
+}
+
+// NOTE: threads, created before profiler was attached, are not reported by runtime, so they are registered here
+static Stack *bindStack() {
+    currentStackEpoch = stacksEpoch.load(std::memory_order_acquire);
+    currentStack = registerStack(currentThread());
+    return currentStack;
+}
+
+static inline Stack *boundStack() {
+    Stack *s = currentStack;
+    if (!s || currentStackEpoch != stacksEpoch.load(std::memory_order_acquire))
+        s = bindStack();
+    return s;
 }
 
 Stack &vsharp::stack() {
-    switchContext();
-    return *currentStack;
+    return *boundStack();
 }
 
 StackFrame &vsharp::topFrame() {
-    switchContext();
-    return currentStack->topFrame();
+    return boundStack()->topFrame();
+}
+
+void vsharp::threadCreated(ThreadID tid) {
+    registerStack(tid);
+}
+
+// NOTE: called after thread has stopped running managed code, so its stack is not used anymore
+void vsharp::threadDestroyed(ThreadID tid) {
+    Stack *s = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(stacksLock);
+        auto it = stacks.find(tid);
+        if (it == stacks.end())
+            return;
+        s = it->second;
+        stacks.erase(it);
+        stacksEpoch.fetch_add(1, std::memory_order_release);
+    }
+    // NOTE: runtime may report destruction on the dying thread itself, then its binding is dropped right away
+    if (currentStack == s)
+        currentStack = nullptr;
+    delete s;
 }
 
 void vsharp::validateStackEmptyness() {
 #ifdef _DEBUG
+    std::lock_guard<std::mutex> lock(stacksLock);
     for (auto &kv : stacks) {
         if (!kv.second->isEmpty()) {
             FAIL_LOUD("Stack is not empty after program termination!!");
@@ -288,6 +334,6 @@ bool vsharp::mainLeft() {
 }
 
 VirtualAddress vsharp::resolve(INT_PTR p) {
-    // TODO: add stack and statics case #do
+    // NOTE: stack, statics and unmanaged regions have ids as well, but they are not reported to server
     return heap.physToVirtAddress(p);
 }
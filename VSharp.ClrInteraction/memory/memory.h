@@ -12,8 +12,21 @@ typedef UINT_PTR ThreadID;
 namespace vsharp {
 
 extern std::function<ThreadID()> currentThread;
-static std::map<ThreadID, Stack *> stacks;
+// NOTE: in lazy heap mode, objects are registered in heap, when they are first seen by probes. Registrar is plain
+//       function, which is called only after check of flag, so that hot probes pay no call in eager mode
+extern bool lazyHeap;
+extern void (*lazyObjectRegistrar)(INT_PTR ref);
+// NOTE: in lazy heap mode, tells whether address points into GC heap, possibly into the middle of object
+extern bool (*lazyHeapContains)(INT_PTR address);
+// NOTE: runtime can not tell, whether address is start of object, so only references, which point to object start by
+//       semantics of instruction, are registered; interior pointers would make registrar read garbage method table
+inline void registerObject(INT_PTR ref) {
+    if (lazyHeap)
+        lazyObjectRegistrar(ref);
+}
 extern Heap heap;
+// NOTE: if non-zero, heap statistics are logged and sent to server before every 'heapStatsPeriod'-th command
+extern unsigned heapStatsPeriod;
 #ifdef _DEBUG
 extern std::map<unsigned, const char*> stringsPool;
 #endif
@@ -21,6 +34,12 @@ extern std::map<unsigned, const char*> stringsPool;
 Stack &stack();
 StackFrame &topFrame();
 
+// NOTE: each thread is bound to its stack on first use, so probes find it with thread-local load and check of shared
+//       epoch, which changes only when some stack is destroyed. Registry of stacks is used only for binding and for
+//       operations over all threads, so it is guarded by plain lock
+void threadCreated(ThreadID tid);
+void threadDestroyed(ThreadID tid);
+
 void mainEntered();
 bool mainLeft();
 
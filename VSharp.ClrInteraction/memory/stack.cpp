@@ -1,39 +1,140 @@
 #include "stack.h"
+#include "memory.h"
 #include "../logging.h"
 #include <cstring>
 #include <cassert>
+#include <new>
 
 using namespace vsharp;
 
-#define CONCRETE UINT32_MAX
+static unsigned varsCells(unsigned count)
+{
+    return (count + cellBits - 1) / cellBits;
+}
+
+PoppedSymbolics::PoppedSymbolics()
+    : m_size(0)
+{
+}
+
+void PoppedSymbolics::spill(unsigned id, unsigned depth)
+{
+    if (m_size == inlineCapacity)
+        m_spilled.assign(m_inline, m_inline + inlineCapacity);
+    else
+        m_spilled.resize(m_size);
+    m_spilled.emplace_back(id, depth);
+    ++m_size;
+}
+
+FrameArena::FrameArena()
+    : m_chunk(0)
+    , m_top(0)
+{
+}
+
+FrameArena::~FrameArena()
+{
+    for (const Chunk &chunk : m_chunks)
+        delete[] chunk.data;
+}
+
+void *FrameArena::allocate(size_t size)
+{
+    size = (size + alignment - 1) & ~(alignment - 1);
+    if (m_chunks.empty() || m_top + size > m_chunks[m_chunk].size) {
+        size_t next = m_chunks.empty() ? 0 : m_chunk + 1;
+        if (next == m_chunks.size() || m_chunks[next].size < size) {
+            size_t newSize = size > chunkSize ? size : chunkSize;
+            m_chunks.insert(m_chunks.begin() + next, Chunk {new char[newSize], newSize});
+        }
+        m_chunk = next;
+        m_top = 0;
+    }
+    void *result = m_chunks[m_chunk].data + m_top;
+    m_top += size;
+    return result;
+}
 
-StackFrame::StackFrame(unsigned resolvedToken, unsigned unresolvedToken, const bool *args, unsigned argsCount)
-    : m_concreteness(nullptr)
+FrameArena::Mark FrameArena::mark() const
+{
+    return Mark {m_chunk, m_top};
+}
+
+void FrameArena::release(const Mark &mark)
+{
+    m_chunk = mark.chunk;
+    m_top = mark.top;
+}
+
+StackFrame::StackFrame(FrameArena *arena, unsigned resolvedToken, unsigned unresolvedToken, unsigned argsCount, bool argsConcreteness)
+    : m_arena(arena)
+    , m_symbolicSlots(nullptr)
     , m_capacity(0)
     , m_concretenessTop(0)
     , m_symbolsCount(0)
-    , m_args(new bool[argsCount])
+    , m_args(nullptr)
     , m_locals(nullptr)
+    , m_symbolicVarsCount(argsConcreteness ? 0 : argsCount)
     , m_resolvedToken(resolvedToken)
     , m_unresolvedToken(unresolvedToken)
     , m_enteredMarker(false)
     , m_spontaneous(false)
+    , m_takenAddresses(nullptr)
 {
-    memcpy(m_args, args, argsCount);
+    m_args = allocateVars(argsCount);
+    if (!argsConcreteness)
+        setBits(m_args, 0, argsCount, true);
     resetPopsTracking();
 }
 
 StackFrame::~StackFrame()
 {
-    delete [] m_concreteness;
+    for (const TakenAddress *taken = m_takenAddresses; taken; taken = taken->next)
+        heap.releaseUntracked(taken->address, taken->size);
+}
+
+void *StackFrame::allocate(size_t size)
+{
+    return m_arena->allocate(size);
 }
 
+cell *StackFrame::allocateVars(unsigned count)
+{
+    auto *vars = (cell *) allocate(varsCells(count) * sizeof(cell));
+    memset(vars, 0, varsCells(count) * sizeof(cell));
+    return vars;
+}
+
+bool StackFrame::var(const cell *vars, unsigned index) const
+{
+    return m_symbolicVarsCount == 0 || !((vars[index / cellBits] >> (index % cellBits)) & 1);
+}
+
+void StackFrame::setVar(cell *vars, unsigned index, bool value)
+{
+    if (value && m_symbolicVarsCount == 0)
+        return;
+    cell mask = (cell) 1 << (index % cellBits);
+    cell &word = vars[index / cellBits];
+    bool wasConcrete = !(word & mask);
+    if (wasConcrete == value)
+        return;
+    if (value) {
+        word &= ~mask;
+        --m_symbolicVarsCount;
+    } else {
+        word |= mask;
+        ++m_symbolicVarsCount;
+    }
+}
+
+// NOTE: frame is configured, when it is on top of the stack, so its storage follows arguments in arena
 void StackFrame::configure(unsigned maxStackSize, unsigned localsCount)
 {
     m_capacity = maxStackSize;
-    m_concreteness = new unsigned[maxStackSize];
-    m_locals = new bool[localsCount];
-    memset(m_locals, true, localsCount);
+    m_symbolicSlots = (unsigned *) allocate(maxStackSize * sizeof(unsigned));
+    m_locals = allocateVars(localsCount);
 }
 
 bool StackFrame::isEmpty() const
@@ -48,22 +149,27 @@ bool StackFrame::isFull() const
 
 bool StackFrame::peek0() const
 {
-    return m_concreteness[m_concretenessTop - 1] == CONCRETE;
+    return peek(0);
 }
 
 bool StackFrame::peek1() const
 {
-    return m_concreteness[m_concretenessTop - 2] == CONCRETE;
+    return peek(1);
 }
 
 bool StackFrame::peek2() const
 {
-    return m_concreteness[m_concretenessTop - 3] == CONCRETE;
+    return peek(2);
 }
 
 bool StackFrame::peek(unsigned idx) const
 {
-    return m_concreteness[m_concretenessTop - idx - 1] == CONCRETE;
+    unsigned slot = m_concretenessTop - idx - 1;
+    for (unsigned i = m_symbolsCount; i > 0 && m_symbolicSlots[i - 1] >= slot; --i) {
+        if (m_symbolicSlots[i - 1] == slot)
+            return false;
+    }
+    return true;
 }
 
 void StackFrame::pop0()
@@ -80,7 +186,9 @@ void StackFrame::push1(bool isConcrete)
         FAIL_LOUD("Stack overflow!");
     }
 #endif
-    m_concreteness[m_concretenessTop++] = isConcrete ? CONCRETE : ++m_symbolsCount;
+    if (!isConcrete)
+        m_symbolicSlots[m_symbolsCount++] = m_concretenessTop;
+    ++m_concretenessTop;
 }
 
 void StackFrame::push1Concrete()
@@ -88,6 +196,7 @@ void StackFrame::push1Concrete()
     push1(true);
 }
 
+// NOTE: ids of symbolic values are their positions among symbolic values of the stack, starting from 1
 bool StackFrame::pop1()
 {
 #ifdef _DEBUG
@@ -98,13 +207,11 @@ bool StackFrame::pop1()
 #endif
     m_lastPoppedSymbolics.clear();
     --m_concretenessTop;
-    unsigned cell = m_concreteness[m_concretenessTop];
-    if (cell != CONCRETE) {
-        --m_symbolsCount;
-        m_lastPoppedSymbolics.emplace_back(cell, 0u);
-        return false;
-    }
-    return true;
+    if (m_symbolsCount == 0 || m_symbolicSlots[m_symbolsCount - 1] != m_concretenessTop)
+        return true;
+    m_lastPoppedSymbolics.emplace_back(m_symbolsCount, 0u);
+    --m_symbolsCount;
+    return false;
 }
 
 
@@ -117,13 +224,11 @@ bool StackFrame::pop(unsigned count)
     }
 #endif
     m_lastPoppedSymbolics.clear();
+    unsigned oldTop = m_concretenessTop;
     m_concretenessTop -= count;
-    for (unsigned i = m_concretenessTop + count; i > m_concretenessTop; --i) {
-        unsigned cell = m_concreteness[i - 1];
-        if (cell != CONCRETE) {
-            --m_symbolsCount;
-            m_lastPoppedSymbolics.emplace_back(cell, m_concretenessTop + count - i);
-        }
+    while (m_symbolsCount > 0 && m_symbolicSlots[m_symbolsCount - 1] >= m_concretenessTop) {
+        m_lastPoppedSymbolics.emplace_back(m_symbolsCount, oldTop - m_symbolicSlots[m_symbolsCount - 1] - 1);
+        --m_symbolsCount;
     }
     return m_lastPoppedSymbolics.empty();
 }
@@ -135,24 +240,49 @@ void StackFrame::pop1Async()
         m_minSymbsCountSinceLastSent = m_symbolsCount;
 }
 
+const StackFrame::TakenAddress *StackFrame::takenAddress(TakenAddressKind kind, unsigned index) const
+{
+    for (const TakenAddress *taken = m_takenAddresses; taken; taken = taken->next) {
+        if (taken->kind == kind && taken->index == index)
+            return taken;
+    }
+    return nullptr;
+}
+
 bool StackFrame::arg(unsigned index) const
 {
-    return m_args[index];
+    if (m_takenAddresses) {
+        if (const TakenAddress *taken = takenAddress(ArgAddress, index))
+            return heap.read(taken->address, taken->size);
+    }
+    return var(m_args, index);
 }
 
 void StackFrame::setArg(unsigned index, bool value)
 {
-    m_args[index] = value;
+    setVar(m_args, index, value);
+    if (m_takenAddresses) {
+        if (const TakenAddress *taken = takenAddress(ArgAddress, index))
+            heap.write(taken->address, taken->size, value);
+    }
 }
 
 bool StackFrame::loc(unsigned index) const
 {
-    return m_locals[index];
+    if (m_takenAddresses) {
+        if (const TakenAddress *taken = takenAddress(LocalAddress, index))
+            return heap.read(taken->address, taken->size);
+    }
+    return var(m_locals, index);
 }
 
 void StackFrame::setLoc(unsigned index, bool value)
 {
-    m_locals[index] = value;
+    setVar(m_locals, index, value);
+    if (m_takenAddresses) {
+        if (const TakenAddress *taken = takenAddress(LocalAddress, index))
+            heap.write(taken->address, taken->size, value);
+    }
 }
 
 bool StackFrame::dup()
@@ -217,14 +347,62 @@ void StackFrame::resetPopsTracking()
     m_minSymbsCountSinceLastSent = m_symbolsCount;
 }
 
-const std::vector<std::pair<unsigned, unsigned>> &StackFrame::poppedSymbolics() const
+const PoppedSymbolics &StackFrame::poppedSymbolics() const
 {
     return m_lastPoppedSymbolics;
 }
 
-void Stack::pushFrame(unsigned resolvedToken, unsigned unresolvedToken, const bool *args, unsigned argsCount)
+// NOTE: records are allocated, when frame is on top of the stack, so they are released with its storage
+void StackFrame::addTakenAddress(TakenAddressKind kind, unsigned index, ADDR address, SIZE size)
+{
+    auto *taken = new (allocate(sizeof(TakenAddress))) TakenAddress {m_takenAddresses, address, size, index, kind};
+    m_takenAddresses = taken;
+}
+
+void StackFrame::addAddressTakenVar(bool isArg, unsigned index, ADDR address, SIZE size)
+{
+    TakenAddressKind kind = isArg ? ArgAddress : LocalAddress;
+    if (size == 0 || takenAddress(kind, index))
+        return;
+    addTakenAddress(kind, index, address, size);
+    // NOTE: memory of frame is concrete, until it is written symbolically, so only symbolic variable is written
+    if (!var(isArg ? m_args : m_locals, index))
+        heap.write(address, size, false);
+}
+
+void StackFrame::addLocalBuffer(ADDR address, SIZE size)
+{
+    if (size != 0)
+        addTakenAddress(BufferAddress, 0, address, size);
+}
+
+Stack::Stack()
+    : m_lastSentTop(0)
+    , m_minTopSinceLastSent(0)
+{
+}
+
+Stack::~Stack()
+{
+    clearFrames();
+}
+
+void Stack::clearFrames()
+{
+    for (StackFrame *frame : m_frames)
+        frame->~StackFrame();
+    if (!m_marks.empty())
+        m_arena.release(m_marks.front());
+    m_frames.clear();
+    m_marks.clear();
+}
+
+StackFrame &Stack::pushFrame(unsigned resolvedToken, unsigned unresolvedToken, unsigned argsCount, bool argsConcreteness)
 {
-    m_frames.push_back(StackFrame(resolvedToken, unresolvedToken, args, argsCount));
+    m_marks.push_back(m_arena.mark());
+    void *storage = m_arena.allocate(sizeof(StackFrame));
+    m_frames.push_back(new (storage) StackFrame(&m_arena, resolvedToken, unresolvedToken, argsCount, argsConcreteness));
+    return *m_frames.back();
 }
 
 
@@ -241,11 +419,14 @@ void Stack::popFrameUntracked()
 #ifdef _DEBUG
     if (m_frames.empty()) {
         FAIL_LOUD("Stack is empty! Can't pop frame!");
-    } else if (!m_frames.back().isEmpty()) {
+    } else if (!m_frames.back()->isEmpty()) {
         FAIL_LOUD("Corrupted stack: opstack is not empty when popping frame!");
     }
 #endif
+    m_frames.back()->~StackFrame();
+    m_arena.release(m_marks.back());
     m_frames.pop_back();
+    m_marks.pop_back();
 }
 
 StackFrame &Stack::topFrame()
@@ -255,7 +436,7 @@ StackFrame &Stack::topFrame()
         FAIL_LOUD("Requesting top frame of empty stack!");
     }
 #endif
-    return m_frames.back();
+    return *m_frames.back();
 }
 
 const StackFrame &Stack::topFrame() const
@@ -265,7 +446,7 @@ const StackFrame &Stack::topFrame() const
         FAIL_LOUD("Requesting top frame of empty stack!");
     }
 #endif
-    return m_frames.back();
+    return *m_frames.back();
 }
 
 bool Stack::isEmpty() const
@@ -280,7 +461,7 @@ unsigned Stack::framesCount() const
 
 unsigned Stack::tokenAt(unsigned index) const
 {
-    return m_frames[index].unresolvedToken();
+    return m_frames[index]->unresolvedToken();
 }
 
 unsigned Stack::unsentPops() const
@@ -298,6 +479,6 @@ void Stack::resetPopsTracking(int framesCount)
     m_lastSentTop = framesCount;
     m_minTopSinceLastSent = m_frames.size();
     if (!m_frames.empty()) {
-        m_frames.back().resetPopsTracking();
+        m_frames.back()->resetPopsTracking();
     }
 }
@@ -2,13 +2,81 @@
 #define STACK_H_
 
 #include <vector>
-#include <stack>
+#include "heap.h"
 
 namespace vsharp {
 
+// NOTE: bump allocator for frames of one thread. Frames are pushed and popped in LIFO order, so popping a frame just
+//       moves the top back. Chunks are kept until the arena is destroyed, so calls, returning to already reached
+//       depth, allocate nothing
+class FrameArena {
+private:
+    struct Chunk {
+        char *data;
+        size_t size;
+    };
+    static const size_t chunkSize = 64 * 1024;
+    static const size_t alignment = 8;
+    std::vector<Chunk> m_chunks;
+    size_t m_chunk;
+    size_t m_top;
+
+public:
+    struct Mark {
+        size_t chunk;
+        size_t top;
+    };
+
+    FrameArena();
+    FrameArena(const FrameArena &other) = delete;
+    FrameArena &operator=(const FrameArena &other) = delete;
+    ~FrameArena();
+
+    void *allocate(size_t size);
+    Mark mark() const;
+    // NOTE: releases everything, allocated since 'mark' was taken
+    void release(const Mark &mark);
+};
+
+// NOTE: symbolic values, popped by the last instruction: pairs of value id and its depth in the popped range.
+//       Instructions pop at most 3 values, so pops fit into inline storage; only calls with many symbolic arguments
+//       spill into the heap, and the spilled buffer is kept for the next time
+class PoppedSymbolics {
+private:
+    static const unsigned inlineCapacity = 8;
+    std::pair<unsigned, unsigned> m_inline[inlineCapacity];
+    std::vector<std::pair<unsigned, unsigned>> m_spilled;
+    unsigned m_size;
+
+public:
+    PoppedSymbolics();
+
+    void clear() { m_size = 0; }
+    void emplace_back(unsigned id, unsigned depth) {
+        if (m_size < inlineCapacity) {
+            m_inline[m_size++] = std::make_pair(id, depth);
+            return;
+        }
+        spill(id, depth);
+    }
+    void spill(unsigned id, unsigned depth);
+
+    bool empty() const { return m_size == 0; }
+    unsigned size() const { return m_size; }
+    const std::pair<unsigned, unsigned> *begin() const {
+        return m_size <= inlineCapacity ? m_inline : m_spilled.data();
+    }
+    const std::pair<unsigned, unsigned> *end() const { return begin() + m_size; }
+};
+
 class StackFrame {
 private:
-    unsigned *m_concreteness;
+    // NOTE: storage of args, locals and evaluation stack
+    FrameArena *m_arena;
+
+    // NOTE: evaluation stack keeps only positions of its symbolic values in ascending order, so while frame has no
+    //       symbolic values, pushes and pops just move the top
+    unsigned *m_symbolicSlots;
     unsigned m_capacity;
     unsigned m_concretenessTop;
 
@@ -16,18 +84,47 @@ private:
     unsigned m_lastSentSymbolsCount;
     unsigned m_minSymbsCountSinceLastSent;
 
-    bool *m_args;
-    bool *m_locals;
+    // NOTE: set bits mark symbolic args and locals; if none of them is symbolic, bitsets are not read
+    cell *m_args;
+    cell *m_locals;
+    unsigned m_symbolicVarsCount;
 
     unsigned m_resolvedToken;
     unsigned m_unresolvedToken;
     bool m_enteredMarker;
     bool m_spontaneous;
 
-    std::vector<std::pair<unsigned, unsigned>> m_lastPoppedSymbolics;
+    PoppedSymbolics m_lastPoppedSymbolics;
+
+    // NOTE: args, locals and local buffers, which addresses were taken by program. They can be changed through
+    //       pointers, so concreteness of them is kept by heap as of untracked memory, which costs nothing, until it is
+    //       written symbolically. Stack addresses are sent to server as numbers, so they are not registered in heap.
+    //       Records are carved from arena and linked into list; symbolic bytes of them are dropped with the frame
+    enum TakenAddressKind {
+        ArgAddress,
+        LocalAddress,
+        BufferAddress
+    };
+    struct TakenAddress {
+        TakenAddress *next;
+        ADDR address;
+        SIZE size;
+        unsigned index;
+        TakenAddressKind kind;
+    };
+    TakenAddress *m_takenAddresses;
+
+    void *allocate(size_t size);
+    cell *allocateVars(unsigned count);
+    bool var(const cell *vars, unsigned index) const;
+    void setVar(cell *vars, unsigned index, bool value);
+    const TakenAddress *takenAddress(TakenAddressKind kind, unsigned index) const;
+    void addTakenAddress(TakenAddressKind kind, unsigned index, ADDR address, SIZE size);
 
 public:
-    StackFrame(unsigned resolvedToken, unsigned unresolvedToken, const bool *args, unsigned argsCount);
+    StackFrame(FrameArena *arena, unsigned resolvedToken, unsigned unresolvedToken, unsigned argsCount, bool argsConcreteness);
+    StackFrame(const StackFrame &other) = delete;
+    StackFrame &operator=(const StackFrame &other) = delete;
     ~StackFrame();
 
     void configure(unsigned maxStackSize, unsigned localsCount);
@@ -64,20 +161,34 @@ public:
     bool isSpontaneous() const;
     void setSpontaneous(bool isUnmanaged);
 
-    const std::vector<std::pair<unsigned, unsigned>> &poppedSymbolics() const;
+    const PoppedSymbolics &poppedSymbolics() const;
     unsigned evaluationStackPops() const;
     unsigned symbolicsCount() const;
     void resetPopsTracking();
+
+    void addAddressTakenVar(bool isArg, unsigned index, ADDR address, SIZE size);
+    void addLocalBuffer(ADDR address, SIZE size);
 };
 
 class Stack {
 private:
-    std::deque<StackFrame> m_frames;
+    // NOTE: frames are constructed in arena, 'm_marks' keep arena top before each frame
+    FrameArena m_arena;
+    std::vector<StackFrame *> m_frames;
+    std::vector<FrameArena::Mark> m_marks;
     unsigned m_lastSentTop;
     unsigned m_minTopSinceLastSent;
 
+    void clearFrames();
+
 public:
-    void pushFrame(unsigned resolvedToken, unsigned unresolvedToken, const bool *args, unsigned argsCount);
+    Stack();
+    Stack(const Stack &other) = delete;
+    Stack &operator=(const Stack &other) = delete;
+    ~Stack();
+
+    // NOTE: arguments are initialized with 'argsConcreteness'
+    StackFrame &pushFrame(unsigned resolvedToken, unsigned unresolvedToken, unsigned argsCount, bool argsConcreteness);
     void popFrame();
     void popFrameUntracked();
     StackFrame &topFrame();
@@ -5,6 +5,8 @@
 #include "memory/memory.h"
 #include "communication/protocol.h"
 #include <vector>
+#include <algorithm>
+#include <atomic>
 
 #define COND INT_PTR
 #define OFFSET UINT32
@@ -38,7 +40,7 @@ struct EvalStackOperand {
 
     size_t size() const {
         if (typ == OpRef)
-            return sizeof(EvalStackArgType) + sizeof(unsigned long) + sizeof(unsigned long);
+            return sizeof(EvalStackArgType) + sizeof(OBJID) + sizeof(UINT64);
         return sizeof(EvalStackArgType) + sizeof(long long);
     }
 
@@ -46,8 +48,8 @@ struct EvalStackOperand {
         *(EvalStackArgType *)buffer = typ;
         buffer += sizeof(EvalStackArgType);
         if (typ == OpRef) {
-            *(unsigned long *)buffer = content.address.obj; buffer += sizeof(unsigned long);
-            *(unsigned long *)buffer = content.address.offset; buffer += sizeof(unsigned long);
+            *(OBJID *)buffer = content.address.obj; buffer += sizeof(OBJID);
+            *(UINT64 *)buffer = content.address.offset; buffer += sizeof(UINT64);
         } else {
             *(long long *)buffer = content.number;
             buffer += sizeof(long long);
@@ -58,8 +60,8 @@ struct EvalStackOperand {
         typ = *(EvalStackArgType *)buffer;
         buffer += sizeof(EvalStackArgType);
         if (typ == OpRef) {
-            content.address.obj = (OBJID) *(unsigned long *)buffer; buffer += sizeof(unsigned long);
-            content.address.offset = (SIZE) *(unsigned long *)buffer; buffer += sizeof(unsigned long);
+            content.address.obj = *(OBJID *)buffer; buffer += sizeof(OBJID);
+            content.address.offset = (SIZE) *(UINT64 *)buffer; buffer += sizeof(UINT64);
         } else {
             content.number = *(long long *)buffer;
             buffer += sizeof(long long);
@@ -75,25 +77,26 @@ struct ExecCommand {
     unsigned evaluationStackPushesCount;
     unsigned evaluationStackPops;
     unsigned newAddressesCount;
+    unsigned deletedAddressesCount;
+    unsigned newTypesCount;
     unsigned *newCallStackFrames;
     EvalStackOperand *evaluationStackPushes;
-    // TODO: add deleted addresses
-    OBJID *newAddresses;
-    unsigned long *newAddressesTypeLengths;
-    char *newAddressesTypes;
+    // NOTE: points to snapshot of allocation log, taken by this thread; it is cleared after the command is sent
+    const AllocationLog *newAddresses;
+    // NOTE: ids of objects, collected since the last command
+    OBJID *deletedAddresses;
 
-    void serialize(char *&bytes, unsigned &count) const {
-        count = 7 * sizeof(unsigned) + sizeof(unsigned) * newCallStackFramesCount;
+    size_t serializedSize() const {
+        size_t count = 9 * sizeof(unsigned) + sizeof(unsigned) * newCallStackFramesCount;
         for (unsigned i = 0; i < evaluationStackPushesCount; ++i)
             count += evaluationStackPushes[i].size();
-        count += sizeof(UINT_PTR) * newAddressesCount;
-        count += newAddressesCount * sizeof(unsigned long);
-        unsigned long fullTypesSize = 0;
-        for (int i = 0; i < newAddressesCount; ++i)
-            fullTypesSize += newAddressesTypeLengths[i];
-        count += fullTypesSize;
-        bytes = new char[count];
-        char *buffer = bytes;
+        count += newAddresses->serializedSize();
+        count += sizeof(OBJID) * deletedAddressesCount;
+        return count;
+    }
+
+    // NOTE: encodes command directly into the frame of protocol, 'buffer' must have 'serializedSize()' free bytes
+    void serialize(char *&buffer) const {
         unsigned size = sizeof(unsigned);
         *(unsigned *)buffer = offset; buffer += size;
         *(unsigned *)buffer = isBranch; buffer += size;
@@ -102,19 +105,43 @@ struct ExecCommand {
         *(unsigned *)buffer = evaluationStackPushesCount; buffer += size;
         *(unsigned *)buffer = evaluationStackPops; buffer += size;
         *(unsigned *)buffer = newAddressesCount; buffer += size;
+        *(unsigned *)buffer = deletedAddressesCount; buffer += size;
+        *(unsigned *)buffer = newTypesCount; buffer += size;
         size = newCallStackFramesCount * sizeof(unsigned);
         memcpy(buffer, (char*)newCallStackFrames, size); buffer += size;
         for (unsigned i = 0; i < evaluationStackPushesCount; ++i) {
             evaluationStackPushes[i].serialize(buffer);
         }
-        size = newAddressesCount * sizeof(UINT_PTR);
-        memcpy(buffer, (char*)newAddresses, size); buffer += size;
-        size = newAddressesCount * sizeof(unsigned long);
-        memcpy(buffer, (char*)newAddressesTypeLengths, size); buffer += size;
-        memcpy(buffer, newAddressesTypes, fullTypesSize); buffer += fullTypesSize;
+        newAddresses->serialize(buffer);
+        size = deletedAddressesCount * sizeof(OBJID);
+        memcpy(buffer, (char*)deletedAddresses, size); buffer += size;
     }
 };
 
+// NOTE: per-thread scratch storage of commands. Buffers only grow, so steady state round trips do not allocate;
+//       operands are consumed by 'sendCommand' before the next probe of the thread fills them again
+struct CommandBuffers {
+    std::vector<EvalStackOperand> operands;
+    std::vector<unsigned> callStackFrames;
+    std::vector<OBJID> deletedAddresses;
+    AllocationLog newAddresses;
+};
+
+static thread_local CommandBuffers commandBuffers;
+
+EvalStackOperand *operandsBuffer(unsigned count) {
+    std::vector<EvalStackOperand> &operands = commandBuffers.operands;
+    if (operands.size() < count)
+        operands.resize(count);
+    return operands.data();
+}
+
+EvalStackOperand *operands(std::initializer_list<EvalStackOperand> values) {
+    EvalStackOperand *ops = operandsBuffer((unsigned) values.size());
+    std::copy(values.begin(), values.end(), ops);
+    return ops;
+}
+
 void initCommand(OFFSET offset, bool isBranch, unsigned opsCount, EvalStackOperand *ops, ExecCommand &command) {
     Stack &stack = vsharp::stack();
     StackFrame &top = stack.topFrame();
@@ -125,14 +152,16 @@ void initCommand(OFFSET offset, bool isBranch, unsigned opsCount, EvalStackOpera
     unsigned currCallFrames = stack.framesCount();
     assert(minCallFrames <= currCallFrames);
     command.newCallStackFramesCount = currCallFrames - minCallFrames;
-    command.newCallStackFrames = new unsigned[command.newCallStackFramesCount];
+    std::vector<unsigned> &callStackFrames = commandBuffers.callStackFrames;
+    callStackFrames.clear();
     for (unsigned i = minCallFrames; i < currCallFrames; ++i) {
-        command.newCallStackFrames[i - minCallFrames] = stack.tokenAt(i);
+        callStackFrames.push_back(stack.tokenAt(i));
     }
+    command.newCallStackFrames = callStackFrames.data();
 
     command.callStackFramesPops = stack.unsentPops();
     unsigned afterPop = top.symbolicsCount();
-    const std::vector<std::pair<unsigned, unsigned>> &poppedSymbs = top.poppedSymbolics();
+    const PoppedSymbolics &poppedSymbs = top.poppedSymbolics();
     unsigned currentSymbs = afterPop + poppedSymbs.size();
     for (auto &pair : poppedSymbs) {
         assert((int)opsCount - (int)pair.second - 1 >= 0);
@@ -144,33 +173,23 @@ void initCommand(OFFSET offset, bool isBranch, unsigned opsCount, EvalStackOpera
     command.evaluationStackPushesCount = opsCount;
     command.evaluationStackPops = top.evaluationStackPops();
     command.evaluationStackPushes = ops;
-    auto newAddresses = heap.flushObjects();
-    auto addressesSize = newAddresses.size();
-    command.newAddressesCount = addressesSize;
-    command.newAddresses = new UINT_PTR[addressesSize];
-    unsigned long fullTypesSize = 0;
-    for (const auto &newAddress : newAddresses)
-        fullTypesSize += newAddress.second.second;
-    command.newAddressesTypes = new char[fullTypesSize];
-    command.newAddressesTypeLengths = new unsigned long[addressesSize];
-    auto begin = command.newAddressesTypes;
-    int i = 0;
-    for (const auto &newAddress : newAddresses) {
-        command.newAddresses[i] = newAddress.first;
-        auto pair = newAddress.second;
-        auto typeSize = pair.second;
-        command.newAddressesTypeLengths[i] = typeSize;
-        if (typeSize != 0) memcpy(command.newAddressesTypes, pair.first, typeSize);
-        command.newAddressesTypes += typeSize;
-        delete pair.first;
-        i++;
-    }
-    command.newAddressesTypes = begin;
+    AllocationLog &newAddresses = commandBuffers.newAddresses;
+    heap.newObjects(newAddresses);
+    command.newAddresses = &newAddresses;
+    command.newAddressesCount = command.newAddresses->count();
+    command.newTypesCount = command.newAddresses->newTypesCount();
+    std::vector<OBJID> &deletedAddresses = commandBuffers.deletedAddresses;
+    heap.flushDeletedObjects(deletedAddresses);
+    command.deletedAddressesCount = deletedAddresses.size();
+    command.deletedAddresses = deletedAddresses.data();
 }
 
 bool readExecResponse(StackFrame &top, EvalStackOperand *ops, unsigned &count, int &framesCount, EvalStackOperand &result) {
     char *bytes; int messageLength;
     protocol->acceptExecResult(bytes, messageLength);
+    // NOTE: server has applied deletions of the command, so their ids can be given to new objects
+    heap.recycleIds(commandBuffers.deletedAddresses);
+    commandBuffers.deletedAddresses.clear();
     char *start = bytes;
     framesCount = *(int*)bytes; bytes += sizeof(int);
     char lastPush = *(char*)bytes; bytes += sizeof(char);
@@ -195,19 +214,9 @@ bool readExecResponse(StackFrame &top, EvalStackOperand *ops, unsigned &count, i
         result.deserialize(bytes);
     }
     assert(bytes - start == messageLength);
-
-    delete start;
     return opsConcretized;
 }
 
-void freeCommand(ExecCommand &command) {
-    delete[] command.newCallStackFrames;
-    delete[] command.evaluationStackPushes;
-    delete[] command.newAddresses;
-    delete[] command.newAddressesTypeLengths;
-    delete[] command.newAddressesTypes;
-}
-
 void updateMemory(EvalStackOperand &op, unsigned int idx) {
     switch (op.typ) {
         case OpI4:
@@ -223,23 +232,34 @@ void updateMemory(EvalStackOperand &op, unsigned int idx) {
             update_f8(op.content.number, (INT8) idx);
             break;
         case OpRef:
-            update_p((INT_PTR) Heap::virtToPhysAddress(op.content.address), (INT8) idx);
+            update_p((INT_PTR) heap.virtToPhysAddress(op.content.address), (INT8) idx);
             break;
         case OpSymbolic:
             FAIL_LOUD("updateMemory: unexpected symbolic value after concretization!");
     }
 }
+void sendHeapStats() {
+    static std::atomic<unsigned> commandsCount(0);
+    if (!heapStatsPeriod || (commandsCount.fetch_add(1, std::memory_order_relaxed) + 1) % heapStatsPeriod != 0)
+        return;
+    HeapStats stats = heap.stats();
+    LOG(tout << "Heap stats: " << stats.toString() << std::endl);
+    protocol->sendSerializable(HeapStatsCommand, stats);
+}
+
 bool sendCommand(OFFSET offset, unsigned opsCount, EvalStackOperand *ops) {
+    sendHeapStats();
     ExecCommand command;
     initCommand(offset, false, opsCount, ops, command);
     protocol->sendSerializable(ExecuteCommand, command);
+    commandBuffers.newAddresses.clear();
     StackFrame &top = vsharp::topFrame();
     int framesCount;
     EvalStackOperand internalCallResult = EvalStackOperand {OpSymbolic, 0};
     unsigned oldOpsCount = opsCount;
     bool opsConcretized = readExecResponse(top, ops, opsCount, framesCount, internalCallResult);
     if (opsConcretized && opsCount > 0) {
-        const std::vector<std::pair<unsigned, unsigned>> &poppedSymbs = top.poppedSymbolics();
+        const PoppedSymbolics &poppedSymbs = top.poppedSymbolics();
         for (const auto &poppedSymb : poppedSymbs) {
             assert((int)opsCount - (int)poppedSymb.second - 1 >= 0);
             unsigned idx = opsCount - poppedSymb.second - 1;
@@ -252,12 +272,11 @@ bool sendCommand(OFFSET offset, unsigned opsCount, EvalStackOperand *ops) {
         updateMemory(internalCallResult, oldOpsCount);
 
     vsharp::stack().resetPopsTracking(framesCount);
-    freeCommand(command);
     return opsConcretized;
 }
 
 bool sendCommand0(OFFSET offset) { return sendCommand(offset, 0, nullptr); }
-bool sendCommand1(OFFSET offset) { return sendCommand(offset, 1, new EvalStackOperand[1]); }
+bool sendCommand1(OFFSET offset) { return sendCommand(offset, 1, operandsBuffer(1)); }
 
 // TODO:
 EvalStackOperand mkop_4(INT32 op) { return {OpI4, (long long)op}; }
@@ -276,14 +295,29 @@ EvalStackOperand mkop_f8(DOUBLE op) {
     return {OpR8, result};
 }
 EvalStackOperand mkop_p(INT_PTR op) {
+    // NOTE: server models only heap locations, so pointers to stack, statics and unmanaged memory are sent as numbers.
+    //       In lazy heap mode, 'op' may be interior pointer, so it can not be registered here. Probes register objects,
+    //       which references or interior pointers they take, so pointer into GC heap, which is still untracked,
+    //       points to object, missed by them; sent as number, it would alias that object on server
+    RegionKind kind = op != 0 ? heap.regionKind(op) : HeapRegion;
+    if (kind != HeapRegion) {
+        if (lazyHeap && kind == UnmanagedRegion && lazyHeapContains(op))
+            FAIL_LOUD("mkop_p: pointer to object, which is not registered in lazy heap");
+        return {OpI8, (long long) op};
+    }
     OperandContent content;
     content.address = resolve(op);
     return {OpRef, content};
 }
+// NOTE: operand is reference to start of object by semantics of instruction, so its object can be registered
+EvalStackOperand mkop_ref(INT_PTR ref) {
+    registerObject(ref);
+    return mkop_p(ref);
+}
 EvalStackOperand mkop_struct(INT_PTR op) { FAIL_LOUD("not implemented"); }
 
 EvalStackOperand* createOps(int opsCount) {
-    auto ops = new EvalStackOperand[opsCount];
+    auto ops = operandsBuffer(opsCount);
     for (int i = 0; i < opsCount; ++i) {
         CorElementType type = unmemType((INT8) i);
         switch (type) {
@@ -346,7 +380,13 @@ PROBE(void, Track_Ldarg_2, (OFFSET offset)) { if (!ldarg(2)) sendCommand0(offset
 PROBE(void, Track_Ldarg_3, (OFFSET offset)) { if (!ldarg(3)) sendCommand0(offset); }
 PROBE(void, Track_Ldarg_S, (UINT8 idx, OFFSET offset)) { if (!ldarg(idx)) sendCommand0(offset); }
 PROBE(void, Track_Ldarg, (UINT16 idx, OFFSET offset)) { if (!ldarg(idx)) sendCommand0(offset); }
-PROBE(void, Track_Ldarga, (INT_PTR ptr, UINT16 idx)) { topFrame().push1Concrete(); }
+// NOTE: after address of variable is taken, its concreteness is kept in memory, so that writes through pointers are
+//       seen by ldarg and ldloc, and starg and stloc are seen by reads through pointers
+PROBE(void, Track_Ldarga, (INT_PTR ptr, INT32 idx, INT32 size, OFFSET offset)) {
+    StackFrame &top = vsharp::topFrame();
+    top.addAddressTakenVar(true, (unsigned) idx, (ADDR) ptr, (SIZE) size);
+    top.push1Concrete();
+}
 
 inline bool ldloc(INT16 idx) {
     StackFrame &top = vsharp::topFrame();
@@ -363,7 +403,11 @@ PROBE(void, Track_Ldloc_2, (OFFSET offset)) { if (!ldloc(2)) sendCommand0(offset
 PROBE(void, Track_Ldloc_3, (OFFSET offset)) { if (!ldloc(3)) sendCommand0(offset); }
 PROBE(void, Track_Ldloc_S, (UINT8 idx, OFFSET offset)) { if (!ldloc(idx)) sendCommand0(offset); }
 PROBE(void, Track_Ldloc, (UINT16 idx, OFFSET offset)) { if (!ldloc(idx)) sendCommand0(offset); }
-PROBE(void, Track_Ldloca, (INT_PTR ptr, UINT16 idx)) { topFrame().push1Concrete(); }
+PROBE(void, Track_Ldloca, (INT_PTR ptr, INT32 idx, INT32 size, OFFSET offset)) {
+    StackFrame &top = vsharp::topFrame();
+    top.addAddressTakenVar(false, (unsigned) idx, (ADDR) ptr, (SIZE) size);
+    top.push1Concrete();
+}
 
 inline bool starg(INT16 idx) {
     StackFrame &top = vsharp::topFrame();
@@ -426,22 +470,22 @@ PROBE(COND, Track_BinOp, ()) {
         top.push1Concrete();
     return concreteness; }
 // TODO: do we need op?
-PROBE(void, Exec_BinOp_4, (UINT16 op, INT32 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_4(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_8, (UINT16 op, INT64 arg1, INT64 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_8(arg1), mkop_8(arg2) }); }
-PROBE(void, Exec_BinOp_f4, (UINT16 op, FLOAT arg1, FLOAT arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_f4(arg1), mkop_f4(arg2) }); }
-PROBE(void, Exec_BinOp_f8, (UINT16 op, DOUBLE arg1, DOUBLE arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_f8(arg1), mkop_f8(arg2) }); }
-PROBE(void, Exec_BinOp_p, (UINT16 op, INT_PTR arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(arg1), mkop_p(arg2) }); }
-PROBE(void, Exec_BinOp_8_4, (UINT16 op, INT64 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_8(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_4_p, (UINT16 op, INT32 arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_4(arg1), mkop_p(arg2) }); }
-PROBE(void, Exec_BinOp_p_4, (UINT16 op, INT_PTR arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_4_ovf, (UINT16 op, INT32 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_4(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_8_ovf, (UINT16 op, INT64 arg1, INT64 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_8(arg1), mkop_8(arg2) }); }
-PROBE(void, Exec_BinOp_f4_ovf, (UINT16 op, FLOAT arg1, FLOAT arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_f4(arg1), mkop_f4(arg2) }); }
-PROBE(void, Exec_BinOp_f8_ovf, (UINT16 op, DOUBLE arg1, DOUBLE arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_f8(arg1), mkop_f8(arg2) }); }
-PROBE(void, Exec_BinOp_p_ovf, (UINT16 op, INT_PTR arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(arg1), mkop_p(arg2) }); }
-PROBE(void, Exec_BinOp_8_4_ovf, (UINT16 op, INT64 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_8(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_4_p_ovf, (UINT16 op, INT32 arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_4(arg1), mkop_p(arg2) }); }
-PROBE(void, Exec_BinOp_p_4_ovf, (UINT16 op, INT_PTR arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(arg1), mkop_4(arg2) }); }
+PROBE(void, Exec_BinOp_4, (UINT16 op, INT32 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_4(arg1), mkop_4(arg2) })); }
+PROBE(void, Exec_BinOp_8, (UINT16 op, INT64 arg1, INT64 arg2, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_8(arg1), mkop_8(arg2) })); }
+PROBE(void, Exec_BinOp_f4, (UINT16 op, FLOAT arg1, FLOAT arg2, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_f4(arg1), mkop_f4(arg2) })); }
+PROBE(void, Exec_BinOp_f8, (UINT16 op, DOUBLE arg1, DOUBLE arg2, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_f8(arg1), mkop_f8(arg2) })); }
+PROBE(void, Exec_BinOp_p, (UINT16 op, INT_PTR arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_p(arg1), mkop_p(arg2) })); }
+PROBE(void, Exec_BinOp_8_4, (UINT16 op, INT64 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_8(arg1), mkop_4(arg2) })); }
+PROBE(void, Exec_BinOp_4_p, (UINT16 op, INT32 arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_4(arg1), mkop_p(arg2) })); }
+PROBE(void, Exec_BinOp_p_4, (UINT16 op, INT_PTR arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_p(arg1), mkop_4(arg2) })); }
+PROBE(void, Exec_BinOp_4_ovf, (UINT16 op, INT32 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_4(arg1), mkop_4(arg2) })); }
+PROBE(void, Exec_BinOp_8_ovf, (UINT16 op, INT64 arg1, INT64 arg2, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_8(arg1), mkop_8(arg2) })); }
+PROBE(void, Exec_BinOp_f4_ovf, (UINT16 op, FLOAT arg1, FLOAT arg2, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_f4(arg1), mkop_f4(arg2) })); }
+PROBE(void, Exec_BinOp_f8_ovf, (UINT16 op, DOUBLE arg1, DOUBLE arg2, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_f8(arg1), mkop_f8(arg2) })); }
+PROBE(void, Exec_BinOp_p_ovf, (UINT16 op, INT_PTR arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_p(arg1), mkop_p(arg2) })); }
+PROBE(void, Exec_BinOp_8_4_ovf, (UINT16 op, INT64 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_8(arg1), mkop_4(arg2) })); }
+PROBE(void, Exec_BinOp_4_p_ovf, (UINT16 op, INT32 arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_4(arg1), mkop_p(arg2) })); }
+PROBE(void, Exec_BinOp_p_4_ovf, (UINT16 op, INT_PTR arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_p(arg1), mkop_4(arg2) })); }
 
 PROBE(void, Track_Ldind, (INT_PTR ptr, OFFSET offset)) {
     // TODO
@@ -455,13 +499,13 @@ PROBE(COND, Track_Stind, (INT_PTR ptr, INT32 sizeOfPtr)) {
     return topFrame().pop(2);
 }
 
-PROBE(void, Exec_Stind_I1, (INT_PTR ptr, INT8 value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_4(value) }); }
-PROBE(void, Exec_Stind_I2, (INT_PTR ptr, INT16 value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_4(value) }); }
-PROBE(void, Exec_Stind_I4, (INT_PTR ptr, INT32 value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_4(value) }); }
-PROBE(void, Exec_Stind_I8, (INT_PTR ptr, INT64 value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_8(value) }); }
-PROBE(void, Exec_Stind_R4, (INT_PTR ptr, FLOAT value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_f4(value) }); }
-PROBE(void, Exec_Stind_R8, (INT_PTR ptr, DOUBLE value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_f8(value) }); }
-PROBE(void, Exec_Stind_ref, (INT_PTR ptr, INT_PTR value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_p(value) }); }
+PROBE(void, Exec_Stind_I1, (INT_PTR ptr, INT8 value, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_p(ptr), mkop_4(value) })); }
+PROBE(void, Exec_Stind_I2, (INT_PTR ptr, INT16 value, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_p(ptr), mkop_4(value) })); }
+PROBE(void, Exec_Stind_I4, (INT_PTR ptr, INT32 value, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_p(ptr), mkop_4(value) })); }
+PROBE(void, Exec_Stind_I8, (INT_PTR ptr, INT64 value, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_p(ptr), mkop_8(value) })); }
+PROBE(void, Exec_Stind_R4, (INT_PTR ptr, FLOAT value, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_p(ptr), mkop_f4(value) })); }
+PROBE(void, Exec_Stind_R8, (INT_PTR ptr, DOUBLE value, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_p(ptr), mkop_f8(value) })); }
+PROBE(void, Exec_Stind_ref, (INT_PTR ptr, INT_PTR value, OFFSET offset)) { sendCommand(offset, 2, operands({ mkop_p(ptr), mkop_ref(value) })); }
 
 inline void conv(OFFSET offset) {
     StackFrame &top = vsharp::topFrame();
@@ -474,10 +518,16 @@ inline void conv(OFFSET offset) {
 PROBE(void, Track_Conv, (OFFSET offset)) { conv(offset); }
 PROBE(void, Track_Conv_Ovf, (OFFSET offset)) { conv(offset); }
 
-PROBE(void, Track_Newarr, (INT_PTR ptr, mdToken typeToken, OFFSET offset)) { /*TODO! Do we need allocated address?*/ }
-PROBE(void, Track_Localloc, (INT_PTR len, OFFSET offset)) { /*TODO*/ }
+PROBE(void, Track_Newarr, (INT_PTR ptr, mdToken typeToken, OFFSET offset)) { registerObject(ptr); /*TODO! Do we need allocated address?*/ }
+PROBE(void, Track_Localloc, (INT_PTR ptr, OFFSET offset)) {
+    StackFrame &top = vsharp::topFrame();
+    top.pop1();
+    top.push1Concrete();
+    // NOTE: size of buffer is stored into memory by instrumentation before localloc
+    top.addLocalBuffer((ADDR) ptr, (SIZE) unmem_p(0));
+}
 PROBE(void, Track_Ldobj, (INT_PTR ptr, OFFSET offset)) { /* TODO! will ptr be always concrete? */ }
-PROBE(void, Track_Ldstr, (INT_PTR ptr)) { topFrame().push1Concrete(); } // TODO: do we need allocated address?
+PROBE(void, Track_Ldstr, (INT_PTR ptr)) { registerObject(ptr); topFrame().push1Concrete(); } // TODO: do we need allocated address?
 PROBE(void, Track_Ldtoken, ()) { topFrame().push1Concrete(); }
 
 PROBE(void, Track_Stobj, (INT_PTR ptr)) {
@@ -493,6 +543,7 @@ PROBE(void, Track_Initobj, (INT_PTR ptr)) {
 }
 
 PROBE(void, Track_Ldlen, (INT_PTR ptr, OFFSET offset)) {
+    registerObject(ptr);
     StackFrame &top = topFrame();
     bool concreteness = top.pop1();
     if (concreteness)
@@ -556,15 +607,22 @@ inline bool ldfld(INT_PTR fieldPtr, INT32 fieldSize) {
 
 // TODO: if objPtr = null, it's static field
 PROBE(void, Track_Ldfld, (INT_PTR objPtr, INT32 fieldOffset, INT32 fieldSize, OFFSET offset)) {
+    registerObject(objPtr);
     if (!ldfld(objPtr + fieldOffset, fieldSize)) {
-        sendCommand(offset, 1, new EvalStackOperand[1] { mkop_p(objPtr) });
+        sendCommand(offset, 1, operands({ mkop_p(objPtr) }));
     } else {
         vsharp::topFrame().push1Concrete();
     }
 }
-PROBE(void, Track_Ldflda, (INT_PTR fieldPtr, mdToken fieldToken, OFFSET offset)) { /*TODO*/ }
+// NOTE: 'objPtr' is 0, if field is taken from value type via managed pointer
+PROBE(void, Track_Ldflda, (INT_PTR objPtr, mdToken fieldToken, OFFSET offset)) {
+    // NOTE: object is registered in lazy heap mode, so that address of field resolves to it in ldind and stind
+    registerObject(objPtr);
+    // TODO
+}
 
 inline bool stfld(mdToken fieldToken, INT_PTR ptr) {
+    registerObject(ptr);
     StackFrame &top = vsharp::topFrame();
     // TODO: check concreteness of memory referenced by ptr
     return top.pop(2);
@@ -572,32 +630,32 @@ inline bool stfld(mdToken fieldToken, INT_PTR ptr) {
 
 PROBE(void, Track_Stfld_4, (mdToken fieldToken, INT_PTR ptr, INT32 value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_4(value) });
+        sendCommand(offset, 2, operands({ mkop_p(ptr), mkop_4(value) }));
     }
 }
 PROBE(void, Track_Stfld_8, (mdToken fieldToken, INT_PTR ptr, INT64 value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_8(value) });
+        sendCommand(offset, 2, operands({ mkop_p(ptr), mkop_8(value) }));
     }
 }
 PROBE(void, Track_Stfld_f4, (mdToken fieldToken, INT_PTR ptr, FLOAT value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_f4(value) });
+        sendCommand(offset, 2, operands({ mkop_p(ptr), mkop_f4(value) }));
     }
 }
 PROBE(void, Track_Stfld_f8, (mdToken fieldToken, INT_PTR ptr, DOUBLE value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_f8(value) });
+        sendCommand(offset, 2, operands({ mkop_p(ptr), mkop_f8(value) }));
     }
 }
 PROBE(void, Track_Stfld_p, (mdToken fieldToken, INT_PTR ptr, INT_PTR value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_p(value) });
+        sendCommand(offset, 2, operands({ mkop_p(ptr), mkop_p(value) }));
     }
 }
 PROBE(void, Track_Stfld_struct, (mdToken fieldToken, INT_PTR ptr, INT_PTR value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_struct(value) });
+        sendCommand(offset, 2, operands({ mkop_p(ptr), mkop_struct(value) }));
     }
 }
 /// TODO: stfld may be called with any value type! :(
@@ -606,7 +664,11 @@ PROBE(void, Track_Ldsfld, (mdToken fieldToken, OFFSET offset)) {
     // TODO
     topFrame().push1Concrete();
 }
-PROBE(void, Track_Ldsflda, (INT_PTR ptr)) { topFrame().push1Concrete(); }
+PROBE(void, Track_Ldsflda, (INT_PTR ptr, INT32 size)) {
+    // NOTE: static fields live as long as their domain, so their regions are never dropped
+    heap.registerRegion((ADDR) ptr, (SIZE) size, StaticRegion, true);
+    topFrame().push1Concrete();
+}
 PROBE(void, Track_Stsfld, (mdToken fieldToken, OFFSET offset)) {
     // TODO
     topFrame().pop1();
@@ -614,11 +676,13 @@ PROBE(void, Track_Stsfld, (mdToken fieldToken, OFFSET offset)) {
 
 PROBE(COND, Track_Ldelema, (INT_PTR ptr, INT_PTR index)) {
     // TODO
+    registerObject(ptr);
     StackFrame &top = vsharp::topFrame();
     return top.pop1() && top.peek0();
 }
 PROBE(COND, Track_Ldelem, (INT_PTR ptr, INT_PTR index)) {
     // TODO
+    registerObject(ptr);
     StackFrame &top = vsharp::topFrame();
     return top.pop1() && top.peek0();
 }
@@ -627,6 +691,7 @@ PROBE(void, Exec_Ldelem, (INT_PTR ptr, INT_PTR index, OFFSET offset)) { /*send c
 
 PROBE(COND, Track_Stelem, (INT_PTR ptr, INT_PTR index)) {
     // TODO
+    registerObject(ptr);
     StackFrame &top = vsharp::topFrame();
     return top.pop(3);
 }
@@ -667,12 +732,8 @@ PROBE(void, Track_Enter, (mdMethodDef token, unsigned maxStackSize, unsigned arg
     } else {
         LOG(tout << "Spontaneous enter! Details: expected token "
                  << HEX(expected) << ", but entered " << HEX(token) << std::endl);
-        auto args = new bool[argsCount];
-        memset(args, true, argsCount);
-        stack.pushFrame(token, token, args, argsCount);
-        top = &stack.topFrame();
+        top = &stack.pushFrame(token, token, argsCount, true);
         top->setSpontaneous(true);
-        delete[] args;
     }
     top->setEnteredMarker(true);
     top->configure(maxStackSize, localsCount);
@@ -682,9 +743,7 @@ PROBE(void, Track_EnterMain, (mdMethodDef token, UINT16 argsCount, bool argsConc
     mainEntered();
     Stack &stack = vsharp::stack();
     assert(stack.isEmpty());
-    auto args = new bool[argsCount];
-    memset(args, argsConcreteness, argsCount);
-    stack.pushFrame(token, token, args, argsCount);
+    stack.pushFrame(token, token, argsCount, argsConcreteness);
     Track_Enter(token, maxStackSize, argsCount, localsCount);
     stack.resetPopsTracking(1);
 }
@@ -700,9 +759,10 @@ PROBE(void, Track_Leave, (UINT8 returnValues, OFFSET offset)) {
 #endif
     if (returnValues) {
         bool returnValue = top.pop1();
+        bool spontaneous = top.isSpontaneous();
         stack.popFrame();
         if (!stack.isEmpty()) {
-            if (!top.isSpontaneous())
+            if (!spontaneous)
                 stack.topFrame().push1(returnValue);
             else
                 LOG(tout << "Ignoring return type because of internal execution in unmanaged context..." << std::endl);
@@ -712,7 +772,7 @@ PROBE(void, Track_Leave, (UINT8 returnValues, OFFSET offset)) {
     } else {
         stack.popFrame();
     }
-    LOG(tout << "Managed leave to frame " << stack.framesCount() << ". After popping top frame stack balance is " << top.count() << std::endl);
+    LOG(tout << "Managed leave to frame " << stack.framesCount() << std::endl);
 }
 
 void leaveMain(OFFSET offset, UINT8 opsCount, EvalStackOperand *ops) {
@@ -729,12 +789,12 @@ void leaveMain(OFFSET offset, UINT8 opsCount, EvalStackOperand *ops) {
     if (opsCount > 0) stack.topFrame().pop1();
     stack.popFrame();
 }
-PROBE(void, Track_LeaveMain_0, (OFFSET offset)) { leaveMain(offset, 0, new EvalStackOperand[0] { }); }
-PROBE(void, Track_LeaveMain_4, (INT32 returnValue, OFFSET offset)) { leaveMain(offset, 1, new EvalStackOperand[1] { mkop_4(returnValue) }); }
-PROBE(void, Track_LeaveMain_8, (INT64 returnValue, OFFSET offset)) { leaveMain(offset, 1, new EvalStackOperand[1] { mkop_8(returnValue) }); }
-PROBE(void, Track_LeaveMain_f4, (FLOAT returnValue, OFFSET offset)) { leaveMain(offset, 1, new EvalStackOperand[1] { mkop_f4(returnValue) }); }
-PROBE(void, Track_LeaveMain_f8, (DOUBLE returnValue, OFFSET offset)) { leaveMain(offset, 1, new EvalStackOperand[1] { mkop_f8(returnValue) }); }
-PROBE(void, Track_LeaveMain_p, (INT_PTR returnValue, OFFSET offset)) { leaveMain(offset, 1, new EvalStackOperand[1] { mkop_p(returnValue) }); }
+PROBE(void, Track_LeaveMain_0, (OFFSET offset)) { leaveMain(offset, 0, nullptr); }
+PROBE(void, Track_LeaveMain_4, (INT32 returnValue, OFFSET offset)) { leaveMain(offset, 1, operands({ mkop_4(returnValue) })); }
+PROBE(void, Track_LeaveMain_8, (INT64 returnValue, OFFSET offset)) { leaveMain(offset, 1, operands({ mkop_8(returnValue) })); }
+PROBE(void, Track_LeaveMain_f4, (FLOAT returnValue, OFFSET offset)) { leaveMain(offset, 1, operands({ mkop_f4(returnValue) })); }
+PROBE(void, Track_LeaveMain_f8, (DOUBLE returnValue, OFFSET offset)) { leaveMain(offset, 1, operands({ mkop_f8(returnValue) })); }
+PROBE(void, Track_LeaveMain_p, (INT_PTR returnValue, OFFSET offset)) { leaveMain(offset, 1, operands({ mkop_p(returnValue) })); }
 
 PROBE(void, Finalize_Call, (UINT8 returnValues)) {
     Stack &stack = vsharp::stack();
@@ -766,30 +826,24 @@ PROBE(VOID, PushFrame, (mdToken unresolvedToken, mdMethodDef resolvedToken, bool
     Stack &stack = vsharp::stack();
     StackFrame &top = stack.topFrame();
     argsCount = newobj ? argsCount + 1 : argsCount;
-    bool *argsConcreteness = new bool[argsCount];
-    if (newobj) {
-        argsConcreteness[0] = true;
-    }
-    memset(newobj ? argsConcreteness + 1 : argsConcreteness, true, argsCount);
     LOG(tout << "Call: resolved_token = " << HEX(resolvedToken) << ", unresolved_token = " << HEX(unresolvedToken) << "\n"
              << "\t\tbalance after pop: " << top.count() << "; pushing frame " << stack.framesCount() + 1 << std::endl);
-    const std::vector<std::pair<unsigned, unsigned>> &poppedSymbs = top.poppedSymbolics();
+    // NOTE: frames are not moved by push, so 'top' stays valid
+    StackFrame &frame = stack.pushFrame(resolvedToken, unresolvedToken, argsCount, true);
+    const PoppedSymbolics &poppedSymbs = top.poppedSymbolics();
     for (auto &pair : poppedSymbs) {
         assert((int)argsCount - (int)pair.second - 1 >= 0);
         unsigned idx = argsCount - pair.second - 1;
         assert(idx < argsCount);
-        argsConcreteness[idx] = false;
+        frame.setArg(idx, false);
     }
     LOG(tout << "Args concreteness: ";
         for (unsigned i = 0; i < argsCount; ++i)
-            tout << argsConcreteness[i];);
-
-    stack.pushFrame(resolvedToken, unresolvedToken, argsConcreteness, argsCount);
-    delete[] argsConcreteness;
+            tout << frame.arg(i););
 }
 
 PROBE(void, Track_CallVirt, (UINT16 count, OFFSET offset)) { Track_Call(count); PushFrame(0, 0, false, count, offset); }
-PROBE(void, Track_Newobj, (INT_PTR ptr)) { topFrame().push1Concrete(); }
+PROBE(void, Track_Newobj, (INT_PTR ptr)) { registerObject(ptr); topFrame().push1Concrete(); }
 PROBE(void, Track_Calli, (mdSignature signature, OFFSET offset)) {
     // TODO
     (void)signature;
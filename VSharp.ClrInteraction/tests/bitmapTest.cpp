@@ -0,0 +1,103 @@
+#include "check.h"
+#include "memory/heap.h"
+#include <random>
+
+using namespace vsharp;
+
+// NOTE: word-wide and vector kernels are checked against bit-by-bit reference implementations
+
+static bool allOnesReference(const cell *words, UINT_PTR count) {
+    for (UINT_PTR i = 0; i < count; ++i)
+        for (UINT_PTR j = 0; j < cellBits; ++j)
+            if (!((words[i] >> j) & 1))
+                return false;
+    return true;
+}
+
+typedef bool (*AllOnesKernel)(const cell *, UINT_PTR);
+
+static void testAllOnes(AllOnesKernel kernel) {
+    std::mt19937_64 rng(1);
+    // NOTE: words are read from unaligned offsets of buffer, so that unaligned vector loads are covered
+    std::vector<cell> buffer(128);
+    for (int round = 0; round < 20000; ++round) {
+        UINT_PTR offset = rng() % 8;
+        UINT_PTR count = rng() % 100;
+        for (cell &word : buffer)
+            word = ~(cell) 0;
+        if (count > 0 && rng() % 3) {
+            UINT_PTR bit = rng() % (count * cellBits);
+            buffer[offset + bit / cellBits] &= ~((cell) 1 << (bit % cellBits));
+        }
+        // NOTE: word right after the range is cleared, kernels must not read past its end
+        buffer[offset + count] = 0;
+        const cell *words = buffer.data() + offset;
+        CHECK(kernel(words, count) == allOnesReference(words, count));
+    }
+}
+
+static void testBitRanges() {
+    std::mt19937 rng(2);
+    const UINT_PTR bitsCount = 2000;
+    std::vector<cell> bits((bitsCount + cellBits - 1) / cellBits, 0);
+    std::vector<bool> model(bitsCount, false);
+    for (int round = 0; round < 50000; ++round) {
+        UINT_PTR from = rng() % bitsCount;
+        UINT_PTR length = rng() % 4 ? rng() % 80 : rng() % (bitsCount - from + 1);
+        UINT_PTR to = std::min(from + length, bitsCount);
+        if (rng() % 2) {
+            bool value = rng() % 4 != 0;
+            setBits(bits.data(), from, to, value);
+            for (UINT_PTR i = from; i < to; ++i)
+                model[i] = value;
+        }
+        bool expected = true;
+        for (UINT_PTR i = from; i < to; ++i)
+            expected = expected && model[i];
+        CHECK(testBits(bits.data(), from, to) == expected);
+    }
+    for (UINT_PTR i = 0; i < bitsCount; ++i)
+        CHECK(((bits[i / cellBits] >> (i % cellBits)) & 1) == (cell) model[i]);
+}
+
+static void testObjectConcreteness() {
+    std::mt19937 rng(3);
+    Heap heap;
+    TypeDescriptor type;
+    const ADDR address = 0x10000;
+    const SIZE size = 5000;
+    heap.registerObject(address, size, &type, 0);
+    std::vector<bool> concrete(size, true);
+    for (int round = 0; round < 50000; ++round) {
+        SIZE offset = rng() % size;
+        SIZE length = 1 + (rng() % 4 ? rng() % 16 : rng() % (size - offset));
+        length = std::min(length, size - offset);
+        if (rng() % 2) {
+            bool value = rng() % 3 != 0;
+            heap.write(address + offset, length, value);
+            for (SIZE i = offset; i < offset + length; ++i)
+                concrete[i] = value;
+        }
+        bool expected = true;
+        for (SIZE i = offset; i < offset + length; ++i)
+            expected = expected && concrete[i];
+        CHECK(heap.read(address + offset, length) == expected);
+    }
+}
+
+int main() {
+    testAllOnes(allOnesScalar);
+    testAllOnes(allOnes);
+#ifdef VECTORIZED_BITMAPS
+    testAllOnes(allOnesSSE2);
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        testAllOnes(allOnesAVX2);
+    else
+        printf("bitmapTest: AVX2 is not supported, its kernel is skipped\n");
+#endif
+    testBitRanges();
+    testObjectConcreteness();
+    printf("bitmapTest: ok\n");
+    return 0;
+}
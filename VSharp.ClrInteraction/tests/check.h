@@ -0,0 +1,16 @@
+#ifndef CHECK_H_
+#define CHECK_H_
+
+#include <cstdio>
+#include <cstdlib>
+
+// NOTE: checks are kept in release builds, unlike asserts; test stops at the first failed one
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (false)
+
+#endif // CHECK_H_
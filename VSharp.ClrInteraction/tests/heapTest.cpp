@@ -0,0 +1,77 @@
+#include "check.h"
+#include "memory/heap.h"
+
+using namespace vsharp;
+
+// NOTE: untracked memory must behave the same with per-object bitmaps and with shadow memory: it is concrete, until
+//       it is written symbolically, and it is reset, when object is registered over it, GC condemns it or its owner
+//       releases it
+static void testUntrackedMemory(bool useShadow) {
+    Heap heap;
+    if (useShadow && !heap.enableShadowMemory()) {
+        printf("heapTest: unable to reserve shadow memory, it is skipped\n");
+        return;
+    }
+    const ADDR base = 0x10000000;
+    CHECK(heap.read(base, 8));
+    heap.write(base, 8, true);
+    CHECK(heap.read(base, 8));
+    CHECK(heap.regionKind(base) == UnmanagedRegion);
+
+    heap.write(base + 4, 8, false);
+    CHECK(heap.read(base, 4));
+    CHECK(!heap.read(base, 8));
+    CHECK(!heap.read(base + 4, 1));
+    CHECK(!heap.read(base + 11, 1));
+    CHECK(heap.read(base + 12, 4));
+    CHECK(heap.regionKind(base + 4) == UnmanagedRegion);
+
+    // NOTE: write, which covers symbolic bytes partially, keeps them and extends them on both sides
+    heap.write(base, 16, false);
+    CHECK(!heap.read(base, 1));
+    CHECK(!heap.read(base + 15, 1));
+    CHECK(heap.read(base + 16, 8));
+    heap.write(base + 2, 2, true);
+    CHECK(heap.read(base + 2, 2));
+    CHECK(!heap.read(base, 2));
+    CHECK(!heap.read(base + 4, 12));
+
+    // NOTE: part of write, which falls into tracked region, is written into it
+    heap.registerRegion(base + 32, 8, StackRegion, true);
+    heap.write(base + 28, 8, false);
+    CHECK(!heap.read(base + 28, 1));
+    CHECK(!heap.read(base + 35, 1));
+    CHECK(heap.read(base + 36, 4));
+    CHECK(heap.regionKind(base + 32) == StackRegion);
+
+    TypeDescriptor type;
+    heap.registerObject(base, 24, &type, 0);
+    CHECK(heap.regionKind(base) == HeapRegion);
+    CHECK(heap.read(base, 24));
+    CHECK(!heap.read(base + 28, 4));
+
+    const ADDR condemned = 0x20000000;
+    heap.write(condemned, 8, false);
+    CHECK(!heap.read(condemned, 8));
+    BOOL collected[] = { true, false, false };
+    std::vector<COR_PRF_GC_GENERATION_RANGE> bounds(1);
+    bounds[0].generation = COR_PRF_GC_GEN_0;
+    bounds[0].rangeStart = condemned - 0x1000;
+    bounds[0].rangeLength = 0x2000;
+    bounds[0].rangeLengthReserved = 0x2000;
+    heap.startGC(1, collected, bounds);
+    heap.clearAfterGC(bounds);
+    CHECK(heap.read(condemned, 8));
+    CHECK(!heap.read(base + 28, 4));
+
+    heap.releaseUntracked(base + 28, 4);
+    CHECK(heap.read(base + 28, 4));
+    CHECK(!heap.read(base + 32, 4));
+}
+
+int main() {
+    testUntrackedMemory(false);
+    testUntrackedMemory(true);
+    printf("heapTest: ok\n");
+    return 0;
+}
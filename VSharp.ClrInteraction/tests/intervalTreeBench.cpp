@@ -0,0 +1,40 @@
+#include "memory/heap.h"
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <random>
+
+using namespace vsharp;
+
+// NOTE: measures point lookups of index for growing number of objects; cost per lookup must stay nearly flat
+static double lookupNanoseconds(size_t objectsCount, size_t lookupsCount) {
+    std::mt19937 rng(1);
+    std::deque<Interval> storage;
+    Intervals index;
+    const ADDR base = 0x7f0000000000ULL;
+    ADDR p = base;
+    for (size_t i = 0; i < objectsCount; ++i) {
+        SIZE size = 24 + 8 * (rng() % 16);
+        storage.emplace_back(p, size);
+        index.add(storage.back());
+        p += size;
+    }
+    std::vector<ADDR> points(lookupsCount);
+    for (ADDR &point : points)
+        point = base + rng() % (p - base);
+    size_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (ADDR point : points)
+        found += index.find(point) != nullptr;
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    if (found != lookupsCount)
+        fprintf(stderr, "unexpected misses: %zu\n", lookupsCount - found);
+    return std::chrono::duration<double, std::nano>(elapsed).count() / lookupsCount;
+}
+
+int main() {
+    printf("%12s %14s\n", "objects", "ns/lookup");
+    for (size_t count = 1000; count <= 1000000; count *= 10)
+        printf("%12zu %14.1f\n", count, lookupNanoseconds(count, 2000000));
+    return 0;
+}
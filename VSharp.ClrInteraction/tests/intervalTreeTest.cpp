@@ -0,0 +1,156 @@
+#include "check.h"
+#include "memory/heap.h"
+#include <deque>
+#include <random>
+
+using namespace vsharp;
+
+// NOTE: index is checked against linear scan over the same intervals
+struct Model {
+    std::deque<Interval> storage;
+    std::vector<Interval *> live;
+    Intervals index;
+
+    Interval *add(ADDR left, SIZE size) {
+        storage.emplace_back(left, size);
+        Interval *interval = &storage.back();
+        live.push_back(interval);
+        index.add(*interval);
+        return interval;
+    }
+
+    const Interval *findLinear(ADDR p) const {
+        for (const Interval *interval : live)
+            if (interval->contains(p))
+                return interval;
+        return nullptr;
+    }
+
+    void checkPoints(std::mt19937 &rng, ADDR low, ADDR high, int count) const {
+        for (int i = 0; i < count; ++i) {
+            ADDR p = low + rng() % (high - low);
+            CHECK(index.find(p) == findLinear(p));
+        }
+        for (const Interval *interval : live) {
+            CHECK(index.find(interval->left) == interval);
+            CHECK(index.find(interval->right) == interval);
+        }
+    }
+};
+
+static void testLookups() {
+    std::mt19937 rng(1);
+    Model model;
+    // NOTE: slots are filled in random order with gaps, so that both fast and slow paths of 'add' are taken
+    const ADDR base = 0x10000;
+    const SIZE slot = 0x100;
+    std::vector<ADDR> slots;
+    for (ADDR i = 0; i < 5000; ++i)
+        slots.push_back(base + i * slot);
+    std::shuffle(slots.begin(), slots.end(), rng);
+    for (size_t i = 0; i < slots.size(); ++i) {
+        if (i % 7 == 0)
+            continue;
+        model.add(slots[i] + rng() % 16, 1 + rng() % (slot - 16));
+    }
+    model.checkPoints(rng, base - slot, base + 5001 * slot, 20000);
+
+    for (int i = 0; i < 1000; ++i) {
+        ADDR left = base + rng() % (5000 * slot);
+        ADDR right = left + rng() % (4 * slot);
+        std::vector<Interval *> expected;
+        for (Interval *interval : model.live)
+            if (interval->right >= left && interval->left <= right)
+                expected.push_back(interval);
+        std::sort(expected.begin(), expected.end(), [](const Interval *x, const Interval *y) { return x->left < y->left; });
+        CHECK(model.index.intersecting(left, right) == expected);
+    }
+
+    for (size_t i = 0; i < model.live.size(); i += 3) {
+        model.index.remove(*model.live[i]);
+        model.live[i] = nullptr;
+    }
+    model.live.erase(std::remove(model.live.begin(), model.live.end(), nullptr), model.live.end());
+    model.checkPoints(rng, base - slot, base + 5001 * slot, 20000);
+}
+
+static void testGC() {
+    std::mt19937 rng(2);
+    Model model;
+    const ADDR base = 0x100000;
+    ADDR p = base;
+    for (int i = 0; i < 3000; ++i) {
+        SIZE size = 24 + 8 * (rng() % 32);
+        model.add(p, size);
+        p += size + 8 * (rng() % 3);
+    }
+
+    // NOTE: compaction slides survivors down; runs of adjacent survivors are reported as one range
+    std::vector<std::pair<Interval, Shift>> moves;
+    std::vector<Interval *> survivors;
+    std::vector<Interval *> dead;
+    ADDR target = base;
+    for (size_t i = 0; i < model.live.size(); ) {
+        if (rng() % 4 == 0) {
+            dead.push_back(model.live[i++]);
+            continue;
+        }
+        size_t j = i + 1;
+        while (j < model.live.size() && rng() % 3 && model.live[j]->left == model.live[j - 1]->right + 1)
+            ++j;
+        ADDR left = model.live[i]->left;
+        ADDR right = model.live[j - 1]->right;
+        moves.emplace_back(Interval(left, right - left + 1), Shift{left, target});
+        for (size_t k = i; k < j; ++k)
+            survivors.push_back(model.live[k]);
+        target += right - left + 1;
+        i = j;
+    }
+    std::vector<std::pair<Interval, Shift>> reported = moves;
+    std::shuffle(reported.begin(), reported.end(), rng);
+    std::sort(reported.begin(), reported.end(), Intervals::lessMove);
+    model.index.moveAndMark(reported);
+    std::vector<Interval *> unmarked = model.index.clearUnmarked();
+    std::sort(unmarked.begin(), unmarked.end());
+    std::sort(dead.begin(), dead.end());
+    CHECK(unmarked == dead);
+    model.live = survivors;
+    model.checkPoints(rng, base, p, 20000);
+
+    // NOTE: sweeping GC keeps survivors in place
+    std::vector<Interval> marked;
+    std::vector<Interval *> kept;
+    for (Interval *interval : model.live)
+        if (rng() % 2) {
+            marked.push_back(*interval);
+            kept.push_back(interval);
+        }
+    model.index.mark(marked);
+    CHECK(model.index.clearUnmarked().size() == model.live.size() - kept.size());
+    model.live = kept;
+    model.checkPoints(rng, base, p, 20000);
+}
+
+static void testMerge() {
+    std::mt19937 rng(3);
+    Model young;
+    Model old;
+    for (ADDR i = 0; i < 2000; ++i) {
+        Model &model = rng() % 2 ? young : old;
+        model.add(0x1000 + i * 0x40, 0x20);
+    }
+    old.index.extract([](Interval *interval) { return (interval->left / 0x40) % 5 == 0; });
+    old.live.erase(std::remove_if(old.live.begin(), old.live.end(), [](Interval *interval) { return (interval->left / 0x40) % 5 == 0; }), old.live.end());
+    old.index.absorb(young.index);
+    CHECK(young.index.isEmpty());
+    old.live.insert(old.live.end(), young.live.begin(), young.live.end());
+    old.checkPoints(rng, 0x1000, 0x1000 + 2000 * 0x40, 20000);
+}
+
+int main() {
+    testLookups();
+    testGC();
+    testMerge();
+    printf("intervalTreeTest: ok\n");
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include "memory/heap.h"
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+using namespace vsharp;
+
+// NOTE: compares concreteness checks and updates of per-object bitmaps, found through object index, with shadow memory
+static volatile size_t sink;
+
+struct Timings {
+    double readWrite;
+    double gc;
+};
+
+static bool measure(bool useShadow, size_t objectsCount, Timings &timings) {
+    Heap heap;
+    if (useShadow && !heap.enableShadowMemory())
+        return false;
+    TypeDescriptor type;
+    std::mt19937 rng(1);
+    const ADDR base = 0x7f0000100000ULL;
+    const SIZE size = 48;
+    std::vector<ADDR> objects;
+    ADDR p = base;
+    for (size_t i = 0; i < objectsCount; ++i) {
+        heap.registerObject(p, size, &type, 0);
+        objects.push_back(p);
+        p += size;
+    }
+    std::vector<COR_PRF_GC_GENERATION_RANGE> noBounds;
+    BOOL collected[3] = {1, 0, 0};
+    heap.startGC(3, collected, noBounds);
+    std::vector<Interval> survived{Interval(base, p - base)};
+    heap.markSurvivedObjects(survived);
+    heap.clearAfterGC(noBounds);
+    for (size_t i = 0; i < objectsCount / 10; ++i)
+        heap.write(objects[rng() % objects.size()] + 16, 8, false);
+
+    std::vector<ADDR> addresses(4000000);
+    for (ADDR &address : addresses)
+        address = objects[rng() % objects.size()] + 8 * (1 + rng() % 4);
+    size_t concrete = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (ADDR address : addresses) {
+        concrete += heap.read(address, 8);
+        heap.write(address, 4, true);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    timings.readWrite = std::chrono::duration<double, std::nano>(elapsed).count() / addresses.size();
+
+    // NOTE: every second object dies, survivors are compacted towards base
+    std::vector<std::pair<Interval, Shift>> moves;
+    ADDR target = base;
+    for (size_t i = 1; i < objects.size(); i += 2) {
+        moves.emplace_back(Interval(objects[i], size), Shift{objects[i], target});
+        target += size;
+    }
+    start = std::chrono::steady_clock::now();
+    heap.startGC(3, collected, noBounds);
+    heap.moveAndMark(moves);
+    heap.clearAfterGC(noBounds);
+    elapsed = std::chrono::steady_clock::now() - start;
+    timings.gc = std::chrono::duration<double, std::milli>(elapsed).count();
+    sink = concrete;
+    return true;
+}
+
+int main() {
+    printf("%10s %24s %24s %16s %16s\n", "objects", "bitmaps, ns/read+write", "shadow, ns/read+write", "bitmaps GC, ms", "shadow GC, ms");
+    for (size_t count = 10000; count <= 1000000; count *= 10) {
+        Timings bitmaps{};
+        Timings shadow{};
+        measure(false, count, bitmaps);
+        if (!measure(true, count, shadow)) {
+            printf("shadow memory could not be reserved\n");
+            return 1;
+        }
+        printf("%10zu %24.1f %24.1f %16.2f %16.2f\n", count, bitmaps.readWrite, shadow.readWrite, bitmaps.gc, shadow.gc);
+    }
+    return 0;
+}
@@ -1,6 +1,7 @@
 namespace VSharp.Concolic
 
 open System
+open System.Collections.Generic
 open System.Diagnostics
 open System.IO
 open System.Runtime.InteropServices
@@ -8,6 +9,35 @@ open VSharp
 open VSharp.Core
 open VSharp.Interpreter.IL
 
+// NOTE: client reuses ids of collected objects, once server has applied their deletion. Symbolic state may still refer
+//       to collected object, for example, from path condition, so each object, reported by client, gets fresh heap
+//       address of server, and reused id never aliases the dead object
+type ObjectAddresses() =
+    let addresses = Dictionary<uint32, int>()
+    let ids = Dictionary<int, uint32>()
+    let mutable lastAddress = 0
+
+    member x.Allocate(id : uint32) =
+        assert(not <| addresses.ContainsKey id)
+        lastAddress <- lastAddress + 1
+        addresses.[id] <- lastAddress
+        ids.[lastAddress] <- id
+        lastAddress
+
+    // NOTE: returns server address of deleted object or 0, if object has never been reported
+    member x.Delete(id : uint32) =
+        let mutable address = 0
+        if addresses.Remove(id, &address) then
+            ids.Remove address |> ignore
+        address
+
+    member x.AddressOf(id : uint32) =
+        if id = 0u then 0 else addresses.[id]
+
+    // NOTE: fails for addresses of deleted objects, they can not be sent to client
+    member x.TryFindId(address : int, [<Out>] id : uint32 byref) =
+        ids.TryGetValue(address, &id)
+
 [<AllowNullLiteral>]
 type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilState : cilState) =
     let extension =
@@ -55,6 +85,8 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
 
     static let mutable id = 0
 
+    let addresses = ObjectAddresses()
+
     let mutable callIsSkipped = false
     let mutable mainReached = false
     let mutable operands : list<_> = List.Empty
@@ -115,7 +147,8 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
             initSymbolicFrame state method
         Array.iter (initFrame cilState.state) c.newCallStackFrames
         let evalStack = EvaluationStack.PopMany (int c.evaluationStackPops) cilState.state.evaluationStack |> snd
-        let allocatedTypes = Array.fold2 (fun types address typ -> PersistentDict.add [int address] (ConcreteType typ) types) cilState.state.allocatedTypes c.newAddresses c.newAddressesTypes
+        let allocatedTypes = Array.fold2 (fun types id typ -> PersistentDict.add [addresses.Allocate id] (ConcreteType typ) types) cilState.state.allocatedTypes c.newAddresses c.newAddressesTypes
+        let allocatedTypes = Array.fold (fun types id -> PersistentDict.remove [addresses.Delete id] types) allocatedTypes c.deletedAddresses
         cilState.state.allocatedTypes <- allocatedTypes
         let mutable maxIndex = 0
         let newEntries = c.evaluationStackPushes |> Array.map (function
@@ -136,7 +169,7 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
                 | _ -> __unreachable__()
             | PointerOp(baseAddress, offset) ->
                 // TODO: what about StackLocation and StaticLocation? #do
-                let address = ConcreteHeapAddress [int32 baseAddress]
+                let address = ConcreteHeapAddress [addresses.AddressOf baseAddress]
                 let typ = TypeOfAddress cilState.state address
                 if offset = 0UL then
                     HeapRef address typ
@@ -180,8 +213,11 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
         let evalRefType baseAddress offset typ =
             match baseAddress, offset.term with
             | HeapLocation({term = ConcreteHeapAddress [address]} as a, _), Concrete(offset, _) ->
-                let obj = (address, uint64 (offset :?> int + metadataSizeOfAddress cilState.state a)) :> obj
-                Some (obj, typ)
+                match addresses.TryFindId address with
+                | true, id ->
+                    let obj = (id, uint64 (offset :?> int + metadataSizeOfAddress cilState.state a)) :> obj
+                    Some (obj, typ)
+                | _ -> None
             // TODO: stack and statics location #do
             | _ -> None
         match term with
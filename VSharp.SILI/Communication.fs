@@ -62,7 +62,7 @@ type evalStackArgType =
 
 type evalStackOperand =
     | NumericOp of evalStackArgType * int64
-    | PointerOp of uint64 * uint64
+    | PointerOp of uint32 * uint64
 
 [<type: StructLayout(LayoutKind.Sequential, Pack=1, CharSet=CharSet.Ansi)>]
 type private execCommandStatic = {
@@ -73,6 +73,8 @@ type private execCommandStatic = {
     evaluationStackPushesCount : uint32
     evaluationStackPops : uint32
     newAddressesCount : uint32
+    deletedAddressesCount : uint32
+    newTypesCount : uint32
 }
 type execCommand = {
     offset : uint32
@@ -81,9 +83,9 @@ type execCommand = {
     evaluationStackPops : uint32
     newCallStackFrames : int32 array
     evaluationStackPushes : evalStackOperand array // NOTE: operands for executing instruction
-    newAddresses : UIntPtr array
+    newAddresses : uint32 array
     newAddressesTypes : Type array
-    // TODO: add deleted addresses
+    deletedAddresses : uint32 array // NOTE: addresses of objects, collected since the previous command
 }
 
 [<type: StructLayout(LayoutKind.Sequential, Pack=1, CharSet=CharSet.Ansi)>]
@@ -94,6 +96,22 @@ type execResponseStaticPart = {
     hasResult : byte
 }
 
+[<type: StructLayout(LayoutKind.Sequential, Pack=1, CharSet=CharSet.Ansi)>]
+type heapStats = {
+    objectsCount : uint64
+    regionsCount : uint64
+    bitmapBytes : uint64
+    typeBytes : uint64
+    pendingNewObjects : uint64
+    pendingDeletedObjects : uint64
+    gen0Collections : uint64
+    gen1Collections : uint64
+    gen2Collections : uint64 // NOTE: includes collections of large and pinned object heaps
+    gen0Microseconds : uint64
+    gen1Microseconds : uint64
+    gen2Microseconds : uint64
+}
+
 type commandFromConcolic =
     | Instrument of rawMethodBody
     | ExecuteInstruction of execCommand
@@ -110,10 +128,13 @@ type Communicator(pipeFile) =
     let executeCommandByte = byte(0x57)
     let readMethodBodyByte = byte(0x58)
     let readStringByte = byte(0x59)
+    let heapStatsCommandByte = byte(0x5A)
     let confirmation = Array.singleton confirmationByte
 
     let server = new NamedPipeServerStream(pipeFile, PipeDirection.InOut)
     let stream = server :> Stream
+    // NOTE: session type table: client sends each type once, then refers to it by its index in this table
+    let typesTable = ResizeArray<Type>()
 
     let reportError (exn : IOException) =
         Logger.error "Error occured during communication with the concolic client! Message: %s" exn.Message
@@ -139,26 +160,36 @@ type Communicator(pipeFile) =
             fail "Communication with CLR: could not get the amount of bytes of the next message. Instead read %d bytes" countCount
         BitConverter.ToInt32(countBytes, 0)
 
+    let readBytes count =
+        let buffer : byte[] = Array.zeroCreate count
+        let mutable bytesRead = 0
+        let mutable newBytesCount = 1
+        while bytesRead < count && newBytesCount > 0 do
+            newBytesCount <- server.Read(buffer, bytesRead, count - bytesRead)
+            bytesRead <- bytesRead + newBytesCount
+        if bytesRead <> count then
+            fail "Communication with CLR: expected %d bytes, but read %d bytes" count bytesRead
+        buffer
+
     let readBuffer () =
-        let chunkSize = 8192
         let count = readCount()
         assert(count <> 0)
         if count < 0 then None
         else
             writeConfirmation()
-            let buffer : byte[] = Array.zeroCreate count
-            let mutable bytesRead = 0
-            while bytesRead < count do
-                let length = min chunkSize (count - bytesRead)
-                let chunk : byte[] = Array.zeroCreate length
-                let offset = bytesRead
-                bytesRead <- bytesRead + server.Read(chunk, 0, length)
-                Array.Copy(chunk, 0, buffer, offset, length)
-            if bytesRead <> count then
-                fail "Communication with CLR: expected %d bytes, but read %d bytes" count bytesRead
-            else
-                writeConfirmation()
-                Some buffer
+            let buffer = readBytes count
+            writeConfirmation()
+            Some buffer
+
+    // NOTE: commands of client are sent in one frame: command byte is followed by payload, frame is confirmed once
+    let readFrame () =
+        let count = readCount()
+        if count < 0 then None
+        elif count = 0 then fail "Communication with CLR: empty command frame"
+        else
+            let frame = readBytes count
+            writeConfirmation()
+            Some frame
 
     let writeBuffer (buffer : byte[]) =
         if buffer.LongLength > int64(Int32.MaxValue) then
@@ -261,30 +292,23 @@ type Communicator(pipeFile) =
         | Some bytes -> BitConverter.ToUInt32(bytes, 0)
         | None -> unexpectedlyTerminated()
 
-    member x.ReadMethodBody() =
-        match readBuffer() with
-        | Some bytes ->
-            let propertiesBytes, rest = Array.splitAt (Marshal.SizeOf typeof<rawMethodProperties>) bytes
-            let properties = x.Deserialize<rawMethodProperties> propertiesBytes
-            let sizeOfSignatureTokens = Marshal.SizeOf typeof<signatureTokens>
-            if int properties.signatureTokensLength <> sizeOfSignatureTokens then
-                fail "Size of received signature tokens buffer mismatch the expected! Probably you've altered the client-side signatures, but forgot to alter the server-side structure (or vice-versa)"
-            let signatureTokenBytes, rest = Array.splitAt sizeOfSignatureTokens rest
-            let assemblyNameBytes, rest = Array.splitAt (int properties.assemblyNameLength) rest
-            let moduleNameBytes, rest = Array.splitAt (int properties.moduleNameLength) rest
-            let signatureTokens = x.Deserialize<signatureTokens> signatureTokenBytes
-            let assemblyName = Encoding.Unicode.GetString(assemblyNameBytes)
-            let moduleName = Encoding.Unicode.GetString(moduleNameBytes)
-            let ilBytes, ehBytes  = Array.splitAt (int properties.ilCodeSize) rest
-            let ehSize = Marshal.SizeOf typeof<rawExceptionHandler>
-            let ehCount = Array.length ehBytes / ehSize
-            let ehs = Array.init ehCount (fun i -> x.Deserialize<rawExceptionHandler>(ehBytes, i * ehSize))
-            {properties = properties; tokens = signatureTokens; assembly = assemblyName; moduleName = moduleName; il = ilBytes; ehs = ehs}
-        | None -> unexpectedlyTerminated()
-
-    member private x.ToUIntPtr =
-        if IntPtr.Size = 4 then fun (bytes : byte[]) index -> BitConverter.ToUInt32(bytes, index) |> UIntPtr
-        else fun (bytes : byte[]) index -> BitConverter.ToUInt64(bytes, index) |> UIntPtr
+    member x.ReadMethodBody (bytes : byte[]) =
+        let propertiesBytes, rest = Array.splitAt (Marshal.SizeOf typeof<rawMethodProperties>) bytes
+        let properties = x.Deserialize<rawMethodProperties> propertiesBytes
+        let sizeOfSignatureTokens = Marshal.SizeOf typeof<signatureTokens>
+        if int properties.signatureTokensLength <> sizeOfSignatureTokens then
+            fail "Size of received signature tokens buffer mismatch the expected! Probably you've altered the client-side signatures, but forgot to alter the server-side structure (or vice-versa)"
+        let signatureTokenBytes, rest = Array.splitAt sizeOfSignatureTokens rest
+        let assemblyNameBytes, rest = Array.splitAt (int properties.assemblyNameLength) rest
+        let moduleNameBytes, rest = Array.splitAt (int properties.moduleNameLength) rest
+        let signatureTokens = x.Deserialize<signatureTokens> signatureTokenBytes
+        let assemblyName = Encoding.Unicode.GetString(assemblyNameBytes)
+        let moduleName = Encoding.Unicode.GetString(moduleNameBytes)
+        let ilBytes, ehBytes  = Array.splitAt (int properties.ilCodeSize) rest
+        let ehSize = Marshal.SizeOf typeof<rawExceptionHandler>
+        let ehCount = Array.length ehBytes / ehSize
+        let ehs = Array.init ehCount (fun i -> x.Deserialize<rawExceptionHandler>(ehBytes, i * ehSize))
+        {properties = properties; tokens = signatureTokens; assembly = assemblyName; moduleName = moduleName; il = ilBytes; ehs = ehs}
 
     member private x.corElementTypeToType (elemType : CorElementType) =
         match elemType with
@@ -304,95 +328,109 @@ type Communicator(pipeFile) =
         | CorElementType.ELEMENT_TYPE_U       -> Some(typeof<UIntPtr>)
         | _ -> None
 
-    member x.ReadExecuteCommand() =
-        match readBuffer() with
-        | Some bytes ->
-            let staticSize = Marshal.SizeOf typeof<execCommandStatic>
-            let staticBytes, dynamicBytes = Array.splitAt staticSize bytes
-            let staticPart = x.Deserialize<execCommandStatic> staticBytes
-            let callStackEntrySize = Marshal.SizeOf typeof<int32>
-            let callStackOffset = (int staticPart.newCallStackFramesCount) * callStackEntrySize
-            let newCallStackFrames = Array.init (int staticPart.newCallStackFramesCount) (fun i -> BitConverter.ToInt32(dynamicBytes, i * callStackEntrySize))
-            let mutable offset = callStackOffset
-            let evaluationStackPushes = Array.init (int staticPart.evaluationStackPushesCount) (fun _ ->
-                let evalStackArgTypeNum = BitConverter.ToInt32(dynamicBytes, offset)
-                offset <- offset + sizeof<int32>
-                let evalStackArgType = LanguagePrimitives.EnumOfValue evalStackArgTypeNum
-                match evalStackArgType with
-                | evalStackArgType.OpRef -> // TODO: mb use UIntPtr? #do
-                    let baseAddr = BitConverter.ToUInt64(dynamicBytes, offset)
-                    offset <- offset + sizeof<uint64>
-                    let shift = BitConverter.ToUInt64(dynamicBytes, offset)
-                    offset <- offset + sizeof<uint64>
-                    PointerOp(baseAddr, shift)
-                | evalStackArgType.OpSymbolic
-                | evalStackArgType.OpI4
-                | evalStackArgType.OpI8
-                | evalStackArgType.OpR4
-                | evalStackArgType.OpR8 ->
-                    let content = BitConverter.ToInt64(dynamicBytes, offset)
-                    offset <- offset + sizeof<int64>
-                    NumericOp(evalStackArgType, content)
-                | _ -> internalfailf "unexpected evaluation stack argument type %O" evalStackArgType)
-            let newAddresses = Array.init (int staticPart.newAddressesCount) (fun _ ->
-                let res = x.ToUIntPtr dynamicBytes offset in offset <- offset + IntPtr.Size; res)
-            // TODO: 2Misha what's with these sizes?
-//            let newAddressesTypesLengths = Array.init (int staticPart.newAddressesCount) (fun _ ->
-//                let res = BitConverter.ToUInt64(dynamicBytes, offset) in offset <- offset + sizeof<uint64>; res)
-            let newAddressesTypes = Array.init (int staticPart.newAddressesCount) (fun _ (*i*) ->
-//                let size = int newAddressesTypesLengths.[i]
-                let rec readType () =
-                    let isValid = BitConverter.ToBoolean(dynamicBytes, offset)
+    member x.ReadExecuteCommand (bytes : byte[]) =
+        let staticSize = Marshal.SizeOf typeof<execCommandStatic>
+        let staticBytes, dynamicBytes = Array.splitAt staticSize bytes
+        let staticPart = x.Deserialize<execCommandStatic> staticBytes
+        let callStackEntrySize = Marshal.SizeOf typeof<int32>
+        let callStackOffset = (int staticPart.newCallStackFramesCount) * callStackEntrySize
+        let newCallStackFrames = Array.init (int staticPart.newCallStackFramesCount) (fun i -> BitConverter.ToInt32(dynamicBytes, i * callStackEntrySize))
+        let mutable offset = callStackOffset
+        let evaluationStackPushes = Array.init (int staticPart.evaluationStackPushesCount) (fun _ ->
+            let evalStackArgTypeNum = BitConverter.ToInt32(dynamicBytes, offset)
+            offset <- offset + sizeof<int32>
+            let evalStackArgType = LanguagePrimitives.EnumOfValue evalStackArgTypeNum
+            match evalStackArgType with
+            | evalStackArgType.OpRef ->
+                let baseAddr = BitConverter.ToUInt32(dynamicBytes, offset)
+                offset <- offset + sizeof<uint32>
+                let shift = BitConverter.ToUInt64(dynamicBytes, offset)
+                offset <- offset + sizeof<uint64>
+                PointerOp(baseAddr, shift)
+            | evalStackArgType.OpSymbolic
+            | evalStackArgType.OpI4
+            | evalStackArgType.OpI8
+            | evalStackArgType.OpR4
+            | evalStackArgType.OpR8 ->
+                let content = BitConverter.ToInt64(dynamicBytes, offset)
+                offset <- offset + sizeof<int64>
+                NumericOp(evalStackArgType, content)
+            | _ -> internalfailf "unexpected evaluation stack argument type %O" evalStackArgType)
+        let newTypes = Array.init (int staticPart.newTypesCount) (fun _ ->
+            let typeLength = BitConverter.ToInt32(dynamicBytes, offset)
+            offset <- offset + sizeof<int32>
+            let typeEnd = offset + typeLength
+            let rec readType () =
+                let isValid = BitConverter.ToBoolean(dynamicBytes, offset)
+                offset <- offset + sizeof<bool>
+                if isValid then
+                    let isArray = BitConverter.ToBoolean(dynamicBytes, offset)
                     offset <- offset + sizeof<bool>
-                    if isValid then
-                        let isArray = BitConverter.ToBoolean(dynamicBytes, offset)
-                        offset <- offset + sizeof<bool>
-                        if isArray then
-                            let corElementType = Microsoft.FSharp.Core.LanguagePrimitives.EnumOfValue<byte, CorElementType>(dynamicBytes.[offset])
-                            offset <- offset + sizeof<byte>
-                            let rank = BitConverter.ToInt32(dynamicBytes, offset)
-                            offset <- offset + sizeof<int32>
-                            match x.corElementTypeToType corElementType with
-                            | Some t -> t.MakeArrayType(rank)
-                            | None ->
-                                let t : Type = readType()
-                                t.MakeArrayType(rank)
-                        else
-                            let token = BitConverter.ToInt32(dynamicBytes, offset)
-                            offset <- offset + sizeof<int>
-                            let assemblySize = BitConverter.ToInt32(dynamicBytes, offset)
-                            offset <- offset + sizeof<int>
-                            // NOTE: truncating null terminator
-                            let assemblyBytes = dynamicBytes.[offset .. offset + assemblySize - 3]
-                            offset <- offset + assemblySize
-                            let assemblyName = Encoding.Unicode.GetString(assemblyBytes)
-                            let assembly = Reflection.loadAssembly assemblyName
-                            let moduleSize = BitConverter.ToInt32(dynamicBytes, offset)
-                            offset <- offset + sizeof<int>
-                            let moduleBytes = dynamicBytes.[offset .. offset + moduleSize - 1]
-                            offset <- offset + moduleSize
-                            let moduleName = Encoding.Unicode.GetString(moduleBytes) |> Path.GetFileName
-                            let typeModule = Reflection.resolveModuleFromAssembly assembly moduleName
-                            let typeArgsCount = BitConverter.ToInt32(dynamicBytes, offset)
-                            offset <- offset + sizeof<int>
-                            let typeArgs = Array.init typeArgsCount (fun _ -> readType())
-                            let resultType = Reflection.resolveTypeFromModule typeModule token
-                            if Array.isEmpty typeArgs then resultType else resultType.MakeGenericType(typeArgs)
-                    else typeof<Void>
-                readType())
-            { offset = staticPart.offset
-              isBranch = staticPart.isBranch
-              callStackFramesPops = staticPart.callStackFramesPops
-              evaluationStackPops = staticPart.evaluationStackPops
-              newCallStackFrames = newCallStackFrames
-              evaluationStackPushes = evaluationStackPushes
-              newAddresses = newAddresses
-              newAddressesTypes = newAddressesTypes }
-        | None -> unexpectedlyTerminated()
+                    if isArray then
+                        let corElementType = Microsoft.FSharp.Core.LanguagePrimitives.EnumOfValue<byte, CorElementType>(dynamicBytes.[offset])
+                        offset <- offset + sizeof<byte>
+                        let rank = BitConverter.ToInt32(dynamicBytes, offset)
+                        offset <- offset + sizeof<int32>
+                        match x.corElementTypeToType corElementType with
+                        | Some t -> t.MakeArrayType(rank)
+                        | None ->
+                            let t : Type = readType()
+                            t.MakeArrayType(rank)
+                    else
+                        let token = BitConverter.ToInt32(dynamicBytes, offset)
+                        offset <- offset + sizeof<int>
+                        let assemblySize = BitConverter.ToInt32(dynamicBytes, offset)
+                        offset <- offset + sizeof<int>
+                        // NOTE: truncating null terminator
+                        let assemblyBytes = dynamicBytes.[offset .. offset + assemblySize - 3]
+                        offset <- offset + assemblySize
+                        let assemblyName = Encoding.Unicode.GetString(assemblyBytes)
+                        let assembly = Reflection.loadAssembly assemblyName
+                        let moduleSize = BitConverter.ToInt32(dynamicBytes, offset)
+                        offset <- offset + sizeof<int>
+                        let moduleBytes = dynamicBytes.[offset .. offset + moduleSize - 1]
+                        offset <- offset + moduleSize
+                        let moduleName = Encoding.Unicode.GetString(moduleBytes) |> Path.GetFileName
+                        let typeModule = Reflection.resolveModuleFromAssembly assembly moduleName
+                        let typeArgsCount = BitConverter.ToInt32(dynamicBytes, offset)
+                        offset <- offset + sizeof<int>
+                        let typeArgs = Array.init typeArgsCount (fun _ -> readType())
+                        let resultType = Reflection.resolveTypeFromModule typeModule token
+                        if Array.isEmpty typeArgs then resultType else resultType.MakeGenericType(typeArgs)
+                else typeof<Void>
+            let typ = readType()
+            assert(offset = typeEnd)
+            typ)
+        typesTable.AddRange newTypes
+        let newAddresses = Array.init (int staticPart.newAddressesCount) (fun _ ->
+            let res = BitConverter.ToUInt32(dynamicBytes, offset) in offset <- offset + sizeof<uint32>; res)
+        let newAddressesTypes = Array.init (int staticPart.newAddressesCount) (fun _ ->
+            // NOTE: type ids are varint-encoded
+            let mutable typeId = 0
+            let mutable shift = 0
+            let mutable hasNext = true
+            while hasNext do
+                let b = dynamicBytes.[offset]
+                offset <- offset + sizeof<byte>
+                typeId <- typeId ||| (int (b &&& 0x7Fuy) <<< shift)
+                shift <- shift + 7
+                hasNext <- (b &&& 0x80uy) <> 0uy
+            typesTable.[typeId])
+        let deletedAddresses = Array.init (int staticPart.deletedAddressesCount) (fun _ ->
+            let res = BitConverter.ToUInt32(dynamicBytes, offset) in offset <- offset + sizeof<uint32>; res)
+        { offset = staticPart.offset
+          isBranch = staticPart.isBranch
+          callStackFramesPops = staticPart.callStackFramesPops
+          evaluationStackPops = staticPart.evaluationStackPops
+          newCallStackFrames = newCallStackFrames
+          evaluationStackPushes = evaluationStackPushes
+          newAddresses = newAddresses
+          newAddressesTypes = newAddressesTypes
+          deletedAddresses = deletedAddresses }
 
     member private x.SizeOfConcrete (typ : Type) =
         if Types.IsValueType typ then sizeof<int> + sizeof<int64>
-        else sizeof<int> + 2 * sizeof<int64>
+        else sizeof<int> + sizeof<uint32> + sizeof<uint64>
 
     member private x.IntegerBytesToLong (obj : obj) =
         let extended =
@@ -434,8 +472,8 @@ type Communicator(pipeFile) =
             // NOTE: null refs handling
             let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<int>), LanguagePrimitives.EnumToValue evalStackArgType.OpRef) in assert success
             index <- index + sizeof<int>
-            let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<uint64>), 0UL) in assert success
-            index <- index + sizeof<uint64>
+            let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<uint32>), 0u) in assert success
+            index <- index + sizeof<uint32>
             let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<uint64>), 0UL) in assert success
             index <- index + sizeof<uint64>
         else
@@ -443,8 +481,8 @@ type Communicator(pipeFile) =
             let address, offset = obj :?> uint32 * uint64
             let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<int>), LanguagePrimitives.EnumToValue evalStackArgType.OpRef) in assert success
             index <- index + sizeof<int>
-            let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<uint64>), uint64 address) in assert success
-            index <- index + sizeof<int64>
+            let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<uint32>), address) in assert success
+            index <- index + sizeof<uint32>
             let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<uint64>), offset) in assert success
             index <- index + sizeof<int64>
         bytes
@@ -491,14 +529,21 @@ type Communicator(pipeFile) =
         writeBuffer message
 
     member x.ReadCommand() =
-        match readBuffer() with
-        | Some bytes ->
-            if bytes.Length <> 1 then fail "Invalid command number!"
-            match bytes.[0] with
+        match readFrame() with
+        | Some frame ->
+            let payload = Array.sub frame 1 (frame.Length - 1)
+            match frame.[0] with
             | b when b = instrumentCommandByte ->
-                x.ReadMethodBody() |> Instrument
+                x.ReadMethodBody payload |> Instrument
             | b when b = executeCommandByte ->
-                x.ReadExecuteCommand() |> ExecuteInstruction
+                x.ReadExecuteCommand payload |> ExecuteInstruction
+            | b when b = heapStatsCommandByte ->
+                // NOTE: statistics are reported by client before command, so the command itself is read next
+                let stats = x.Deserialize<heapStats> payload
+                Logger.info "Concolic heap: %d objects, %d regions, %d bytes of bitmaps, %d bytes of types, %d new and %d deleted objects pending, GCs: %d/%d/%d, %d/%d/%d us"
+                    stats.objectsCount stats.regionsCount stats.bitmapBytes stats.typeBytes stats.pendingNewObjects stats.pendingDeletedObjects
+                    stats.gen0Collections stats.gen1Collections stats.gen2Collections stats.gen0Microseconds stats.gen1Microseconds stats.gen2Microseconds
+                x.ReadCommand()
             | b -> fail "Unexpected command %d from client machine!" b
         | None -> Terminate
 
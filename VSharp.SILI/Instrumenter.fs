@@ -299,6 +299,19 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
         | OpCodeValues.Stind_Ref -> System.IntPtr.Size
         | _ -> __unreachable__()
 
+    // NOTE: sizes of generic parameters are unknown before instantiation, so only pointer-sized slot is tracked for them
+    member private x.SizeOfLocation (typ : System.Type) =
+        if typ.IsByRef || typ.IsPointer || typ.ContainsGenericParameters then System.IntPtr.Size
+        else TypeUtils.internalSizeOf typ
+
+    member private x.SizeOfArg idx =
+        let idx = if Reflection.hasThis x.m then idx - 1 else idx
+        if idx < 0 then System.IntPtr.Size
+        else x.SizeOfLocation (x.m.GetParameters().[idx].ParameterType)
+
+    member private x.SizeOfLocal idx =
+        x.SizeOfLocation (x.m.GetMethodBody().LocalVariables.[idx].LocalType)
+
     member private x.PrependMemUnmemForType(t : evaluationStackCellType, idx, order, instr : ilInstr byref) =
         match t with
         | evaluationStackCellType.I1 ->
@@ -359,17 +372,17 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                     hasPrefix <- true
 
                 // Concrete instructions
-                | OpCodeValues.Ldarga_S ->
-                    x.AppendProbe(probes.ldarga, [(OpCodes.Ldc_I4, instr.Arg8 |> int |> Arg32)], x.tokens.void_i_u2_sig, instr)
-                    x.AppendDup instr
-                | OpCodeValues.Ldloca_S ->
-                    x.AppendProbe(probes.ldloca, [(OpCodes.Ldc_I4, instr.Arg8 |> int |> Arg32)], x.tokens.void_i_u2_sig, instr)
-                    x.AppendDup instr
+                | OpCodeValues.Ldarga_S
                 | OpCodeValues.Ldarga ->
-                    x.AppendProbe(probes.ldarga, [(OpCodes.Ldc_I4, instr.Arg16 |> int |> Arg32)], x.tokens.void_i_u2_sig, instr)
+                    let idx = if opcodeValue = OpCodeValues.Ldarga_S then int instr.Arg8 else int instr.Arg16
+                    let args = [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, x.SizeOfArg idx |> Arg32)]
+                    x.AppendProbeWithOffset(probes.ldarga, args, x.tokens.void_i_i4_i4_offset_sig, instr)
                     x.AppendDup instr
+                | OpCodeValues.Ldloca_S
                 | OpCodeValues.Ldloca ->
-                    x.AppendProbe(probes.ldloca, [(OpCodes.Ldc_I4, instr.Arg16 |> int |> Arg32)], x.tokens.void_i_u2_sig, instr)
+                    let idx = if opcodeValue = OpCodeValues.Ldloca_S then int instr.Arg8 else int instr.Arg16
+                    let args = [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, x.SizeOfLocal idx |> Arg32)]
+                    x.AppendProbeWithOffset(probes.ldloca, args, x.tokens.void_i_i4_i4_offset_sig, instr)
                     x.AppendDup instr
                 | OpCodeValues.Ldnull
                 | OpCodeValues.Ldc_I4_M1
@@ -708,7 +721,10 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                      x.AppendInstr OpCodes.Conv_I NoArg instr
                      x.AppendDup instr
                 | OpCodeValues.Localloc ->
-                     x.AppendProbeWithOffset(probes.newarr, [], x.tokens.void_i_offset_sig, instr)
+                     // NOTE: size of buffer is stored into memory, so that probe could register the allocated region
+                     x.PrependDup &prependTarget
+                     x.PrependMem_p(0, 0, &prependTarget)
+                     x.AppendProbeWithOffset(probes.localloc, [], x.tokens.void_i_offset_sig, instr)
                      x.AppendDup instr
                 | OpCodeValues.Cpobj ->
                     // calli mem2
@@ -769,7 +785,10 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                      x.PrependProbeWithOffset(probes.ldfld, [], x.tokens.void_i_i4_i4_offset_sig, &prependTarget) |> ignore
                      x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &instr) |> ignore
                 | OpCodeValues.Ldflda ->
-                     x.PrependDup &prependTarget
+                     // NOTE: probe registers object in lazy heap mode, so managed pointers to value types are not passed to it
+                     match instr.stackState with
+                     | Some (evaluationStackCellType.Ref :: _) -> x.PrependDup &prependTarget
+                     | _ -> x.PrependInstr(OpCodes.Ldc_I4, Arg32 0, &prependTarget)
                      x.PrependInstr(OpCodes.Conv_I, NoArg, &prependTarget)
                      x.PrependInstr(OpCodes.Ldc_I4, instr.arg, &prependTarget)
                      x.PrependProbeWithOffset(probes.ldflda, [], x.tokens.void_i_token_offset_sig, &prependTarget) |> ignore
@@ -843,8 +862,9 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                     x.PrependInstr(OpCodes.Ldc_I4, instr.arg, &prependTarget)
                     x.PrependProbeWithOffset(probes.ldsfld, [], x.tokens.void_token_offset_sig, &prependTarget) |> ignore
                 | OpCodeValues.Ldsflda ->
-                    x.PrependDup &prependTarget
-                    x.PrependProbe(probes.ldsflda, [], x.tokens.void_sig, &prependTarget) |> ignore
+                    let field = Reflection.resolveField x.m instr.Arg32
+                    x.AppendProbe(probes.ldsflda, [(OpCodes.Ldc_I4, x.SizeOfLocation field.FieldType |> Arg32)], x.tokens.void_i_i4_sig, instr)
+                    x.AppendDup instr
                 | OpCodeValues.Stsfld ->
                     x.PrependInstr(OpCodes.Ldc_I4, instr.arg, &prependTarget)
                     x.PrependProbeWithOffset(probes.stsfld, [], x.tokens.void_token_offset_sig, &prependTarget) |> ignore
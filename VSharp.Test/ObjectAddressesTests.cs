@@ -0,0 +1,35 @@
+using NUnit.Framework;
+using VSharp.Concolic;
+
+namespace UnitTests
+{
+    [TestFixture]
+    public sealed class ObjectAddressesTests
+    {
+        [Test]
+        public void ReusedIdGetsFreshAddress()
+        {
+            var addresses = new ObjectAddresses();
+            int first = addresses.Allocate(5);
+            Assert.AreEqual(first, addresses.AddressOf(5));
+            Assert.AreEqual(first, addresses.Delete(5));
+            Assert.IsFalse(addresses.TryFindId(first, out _));
+
+            // Client reuses id of collected object, but server state, which refers to the dead one, must not see it
+            int second = addresses.Allocate(5);
+            Assert.AreNotEqual(first, second);
+            Assert.AreEqual(second, addresses.AddressOf(5));
+            Assert.IsFalse(addresses.TryFindId(first, out _));
+            Assert.IsTrue(addresses.TryFindId(second, out uint id));
+            Assert.AreEqual(5u, id);
+        }
+
+        [Test]
+        public void UnknownIdsAreIgnored()
+        {
+            var addresses = new ObjectAddresses();
+            Assert.AreEqual(0, addresses.Delete(7));
+            Assert.AreEqual(0, addresses.AddressOf(0));
+        }
+    }
+}